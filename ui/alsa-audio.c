@@ -27,49 +27,233 @@
 
 #include <asoundlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include "audio.h"
+#include "dsp.h"
+#include "resample.h"
 
+/// Length of the fade applied when playback stops or jumps
+#define FADE_MS 5
+/// Audio right after the hardware pointer that may already be in flight
+#define GUARD_MS 2
 
-static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
+/// Device buffer with timer scheduling, unless -b says otherwise
+#define TSCHED_BUFFER_MS 2000
+/// Audio left in the device when the timer tops it up, doubled after each xrun
+#define TSCHED_WATERMARK_MS 200
+
+/// Formats whose negotiated parameters are remembered
+#define FORMAT_CACHE 8
+/// Where calibration keeps the best device setup, under $XDG_CONFIG_HOME or
+/// ~/.config
+#define PROFILE_DIR "pandaui"
+#define PROFILE_NAME "alsa-profile"
+/// Length of the synthetic run for each calibration candidate
+#define CALIBRATE_MS 750
+
+/// Xrun times remembered, also the highest usable xrun_limit
+#define XRUN_HISTORY 16
+/// Xruns within XRUN_WINDOW_MS that make the device buffer grow
+#define XRUN_LIMIT 3
+#define XRUN_WINDOW_MS 30000
+/// Time without xruns after which a grown buffer is halved again
+#define XRUN_STABLE_MS 120000
+/// Largest buffer, as a multiple of the one first configured
+#define XRUN_MAX_GROWTH 8
+
+/**
+ * What the device settled on for one requested format and size
+ */
+struct alsa_format {
+	int rate;		/* As requested */
+	int channels;
+	snd_pcm_uframes_t want_period;
+	snd_pcm_uframes_t want_buffer;
+	unsigned int actual_rate;	/* As negotiated */
+	int actual_channels;
+	int mmap;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+};
+
+static struct alsa_state {
+	snd_pcm_t *h;
+	char device[128];	/* Device to open */
+	snd_pcm_uframes_t want_period;	/* Requested sizes, 0 for the defaults */
+	snd_pcm_uframes_t want_buffer;
+	int rate;	/* Device format */
+	int channels;
+	int in_rate;	/* Stream format the device was opened for */
+	int in_channels;
+	int mmap;	/* Device accepted mmap access, copy straight into its buffer */
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t buffer_size;
+	int16_t *stage;	/* Period assembly buffer for RW access */
+	int staged;		/* Frames in stage */
+	int stage_pos;		/* Of those, frames the device has taken */
+	int nonblock;		/* Device was opened with SND_PCM_NONBLOCK */
+	int rw;			/* Never ask for mmap access */
+	int tsched;		/* Wake on a timer from the delay instead of on periods */
+	int nowake;		/* The device does not interrupt for periods either */
+	int watermark_ms;	/* Audio left in the device when the timer fires */
+	int tfd;		/* Timer for tsched */
+	int wakeups;		/* Times the thread woke in the stats interval */
+
+	audio_fifo_data_t *cur;	/* Chunk being written */
+	int pos;		/* Frames of cur already written */
+
+	int64_t stats_us;	/* Start of the current stats interval */
+	int writes;		/* Device writes in the interval */
+	int chunks;		/* Fifo chunks consumed in the interval */
+
+	int xruns;		/* Underruns since the driver started */
+	int suspends;		/* Power management suspends likewise */
+	int interval_xruns;	/* Xruns in the stats interval */
+	int64_t xrun_us[XRUN_HISTORY];	/* When the latest xruns happened, a ring indexed by xruns */
+	int64_t suspend_us;	/* When the device was last suspended */
+	int64_t calm_us;	/* Last xrun or buffer size change */
+	int64_t grown_us;	/* Last buffer size change */
+	int want_grow;		/* Enough xruns to grow the buffer at the next chance */
+	int want_resize;	/* want_buffer changed, apply it once the device is empty */
+	snd_pcm_uframes_t base_buffer;	/* Buffer size before any growth */
+
+	resampler_t rs;		/* Converts chunks the device can't take as they are */
+	audio_fifo_data_t *conv;	/* Converted chunk, owned by the driver */
+	int conv_cap;		/* Samples conv has room for */
+	int64_t conv_us;	/* Conversion time in the interval */
+	int64_t conv_frames;	/* Frames converted in the interval */
+
+	int busy;		/* Inside a device write, transport changes must wait */
+	int want_flush;		/* Fifo was flushed, drop what the device holds */
+	int want_pause;		/* Pause state the fifo asks for */
+	int paused;		/* Pause state the device is in */
+	int probe;		/* Report latency after the next write */
+	TAILQ_HEAD(, audio_fifo_data) carry;	/* Audio taken back from the device on pause */
+	TAILQ_HEAD(, audio_fifo_data) kept;	/* Chunks reserved for alsa_carry() */
+	audio_fifo_data_t *next;	/* First chunk after a flush, held until it is done */
+	audio_fifo_t *af;
+
+	struct pollfd *pfd;	/* Fifo eventfd, then the device's descriptors */
+	int npfd;		/* Number of device descriptors */
+
+	struct alsa_format formats[FORMAT_CACHE];
+	int nformats;		/* Formats ever negotiated */
+} state;
+
+static snd_pcm_t *alsa_open(const char *dev)
+{
+	snd_pcm_t *h;
+
+	if (snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK,
+	                 state.nonblock ? SND_PCM_NONBLOCK : 0) < 0)
+		return NULL;
+
+	return h;
+}
+
+/**
+ * Look up what the device negotiated for \p rate and \p channels before,
+ * at the period and buffer sizes asked for now.
+ */
+static struct alsa_format *alsa_cached(int rate, int channels)
+{
+	struct alsa_format *f;
+	int i;
+
+	for (i = 0; i < state.nformats && i < FORMAT_CACHE; ++i) {
+		f = &state.formats[i];
+		if (f->rate == rate && f->channels == channels &&
+		    f->want_period == state.want_period && f->want_buffer == state.want_buffer)
+			return f;
+	}
+
+	return NULL;
+}
+
+/**
+ * Apply hardware and software parameters for \p rate and \p channels to
+ * the open, unconfigured device. A format negotiated before is set
+ * directly from the cache, skipping the min/max queries and the
+ * _near() searches.
+ *
+ * @return 1 if the cache was used, 0 if the format was negotiated, or a
+ *         negative error code
+ */
+static int alsa_configure(int rate, int channels)
 {
 	snd_pcm_hw_params_t *hwp;
 	snd_pcm_sw_params_t *swp;
-	snd_pcm_t *h;
+	snd_pcm_t *h = state.h;
+	struct alsa_format *f = alsa_cached(rate, channels);
 	int r;
 	int dir;
-	snd_pcm_uframes_t period_size_min;
-	snd_pcm_uframes_t period_size_max;
-	snd_pcm_uframes_t buffer_size_min;
-	snd_pcm_uframes_t buffer_size_max;
 	snd_pcm_uframes_t period_size;
 	snd_pcm_uframes_t buffer_size;
-
-	if ((r = snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK, 0) < 0))
-		return NULL;
+	unsigned int actual_rate = rate;
+	int actual_channels = channels;
 
 	hwp = alloca(snd_pcm_hw_params_sizeof());
 	memset(hwp, 0, snd_pcm_hw_params_sizeof());
 	snd_pcm_hw_params_any(h, hwp);
 
-	snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (f) {
+		snd_pcm_hw_params_set_access(h, hwp, f->mmap ?
+		                             SND_PCM_ACCESS_MMAP_INTERLEAVED :
+		                             SND_PCM_ACCESS_RW_INTERLEAVED);
+		snd_pcm_hw_params_set_format(h, hwp, SND_PCM_FORMAT_S16_LE);
+		snd_pcm_hw_params_set_rate(h, hwp, f->actual_rate, 0);
+		snd_pcm_hw_params_set_channels(h, hwp, f->actual_channels);
+		snd_pcm_hw_params_set_period_size(h, hwp, f->period_size, 0);
+		snd_pcm_hw_params_set_buffer_size(h, hwp, f->buffer_size);
+
+		state.mmap = f->mmap;
+		actual_rate = f->actual_rate;
+		actual_channels = f->actual_channels;
+		period_size = f->period_size;
+		buffer_size = f->buffer_size;
+		goto apply;
+	}
+
+	/* Prefer mmap so chunks are copied once, straight into the DMA buffer */
+	state.mmap = !state.rw &&
+	             snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+	if (!state.mmap)
+		snd_pcm_hw_params_set_access(h, hwp, SND_PCM_ACCESS_RW_INTERLEAVED);
 	snd_pcm_hw_params_set_format(h, hwp, SND_PCM_FORMAT_S16_LE);
-	snd_pcm_hw_params_set_rate(h, hwp, rate, 0);
-	snd_pcm_hw_params_set_channels(h, hwp, channels);
 
-	/* Configurue period */
+	/* Take whatever rate the device is closest to and convert to it */
+	snd_pcm_hw_params_set_rate_near(h, hwp, &actual_rate, 0);
+	if (actual_rate != rate)
+		fprintf(stderr, "audio: device runs at %u Hz, resampling from %d Hz\n",
+		        actual_rate, rate);
 
-	dir = 0;
-	snd_pcm_hw_params_get_period_size_min(hwp, &period_size_min, &dir);
-	dir = 0;
-	snd_pcm_hw_params_get_period_size_max(hwp, &period_size_max, &dir);
+	if (snd_pcm_hw_params_set_channels(h, hwp, channels) < 0) {
+		fprintf(stderr, "audio: device refuses %d channels, upmixing to stereo\n",
+		        channels);
+		actual_channels = 2;
+		snd_pcm_hw_params_set_channels(h, hwp, actual_channels);
+	}
+
+	/* Configurue period */
 
-	period_size = 1024;
+	/* A timer tops the buffer up, periods only matter to the hardware */
+	if (state.tsched) {
+		buffer_size = state.want_buffer ? state.want_buffer :
+		              (snd_pcm_uframes_t)actual_rate * TSCHED_BUFFER_MS / 1000;
+		period_size = state.want_period ? state.want_period : buffer_size / 4;
+	} else {
+		period_size = state.want_period ? state.want_period : 1024;
+	}
 
 	dir = 0;
 	r = snd_pcm_hw_params_set_period_size_near(h, hwp, &period_size, &dir);
@@ -77,8 +261,7 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to set period size %lu (%s)\n",
 		        period_size, snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	dir = 0;
@@ -87,24 +270,20 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to get period size (%s)\n",
 		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	/* Configurue buffer size */
 
-	snd_pcm_hw_params_get_buffer_size_min(hwp, &buffer_size_min);
-	snd_pcm_hw_params_get_buffer_size_max(hwp, &buffer_size_max);
-	buffer_size = period_size * 4;
+	if (!state.tsched)
+		buffer_size = state.want_buffer ? state.want_buffer : period_size * 4;
 
-	dir = 0;
 	r = snd_pcm_hw_params_set_buffer_size_near(h, hwp, &buffer_size);
 
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to set buffer size %lu (%s)\n",
 		        buffer_size, snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	r = snd_pcm_hw_params_get_buffer_size(hwp, &buffer_size);
@@ -112,18 +291,26 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to get buffer size (%s)\n",
 		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
+apply:
+	state.nowake = state.tsched && snd_pcm_hw_params_can_disable_period_wakeup(hwp) &&
+	               snd_pcm_hw_params_set_period_wakeup(h, hwp, 0) == 0;
+
+	state.rate = actual_rate;
+	state.channels = actual_channels;
+	state.period_size = period_size;
+	state.buffer_size = buffer_size;
+	state.stage = realloc(state.stage, buffer_size * actual_channels * sizeof(int16_t));
+
 	/* write the hw params */
 	r = snd_pcm_hw_params(h, hwp);
 
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to configure hardware parameters (%s)\n",
 		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	/*
@@ -131,7 +318,7 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	 */
 
 	swp = alloca(snd_pcm_sw_params_sizeof());
-	memset(hwp, 0, snd_pcm_sw_params_sizeof());
+	memset(swp, 0, snd_pcm_sw_params_sizeof());
 	snd_pcm_sw_params_current(h, swp);
 
 	r = snd_pcm_sw_params_set_avail_min(h, swp, period_size);
@@ -139,17 +326,15 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to configure wakeup threshold (%s)\n",
 		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
-	snd_pcm_sw_params_set_start_threshold(h, swp, 0);
+	r = snd_pcm_sw_params_set_start_threshold(h, swp, 0);
 
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to configure start threshold (%s)\n",
 		        snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	r = snd_pcm_sw_params(h, swp);
@@ -157,87 +342,1388 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	if (r < 0) {
 		fprintf(stderr, "audio: Cannot set soft parameters (%s)\n",
 		snd_strerror(r));
-		snd_pcm_close(h);
-		return NULL;
+		return r;
 	}
 
 	r = snd_pcm_prepare(h);
 	if (r < 0) {
 		fprintf(stderr, "audio: Cannot prepare audio for playback (%s)\n",
 		snd_strerror(r));
-		snd_pcm_close(h);
+		return r;
+	}
+
+	state.npfd = snd_pcm_poll_descriptors_count(h);
+	state.pfd = realloc(state.pfd, (state.npfd + 1) * sizeof(struct pollfd));
+
+	if (f)
+		return 1;
+
+	/* Remember the outcome, replacing the oldest entry once full */
+	f = &state.formats[state.nformats++ % FORMAT_CACHE];
+	f->rate = rate;
+	f->channels = channels;
+	f->want_period = state.want_period;
+	f->want_buffer = state.want_buffer;
+	f->actual_rate = actual_rate;
+	f->actual_channels = actual_channels;
+	f->mmap = state.mmap;
+	f->period_size = period_size;
+	f->buffer_size = buffer_size;
+
+	return 0;
+}
+
+/**
+ * Turn \p frames of interleaved stereo, as the resampler gives it, into
+ * \p channels in place: a mono device gets the average, any channels past
+ * the first two get silence. The buffer must hold the wider of the two.
+ */
+static void alsa_remap(int16_t *buf, int frames, int channels)
+{
+	int i, c;
+
+	if (channels == 1) {
+		for (i = 0; i < frames; ++i)
+			buf[i] = (buf[2 * i] + buf[2 * i + 1]) / 2;
+	} else if (channels > 2) {
+		for (i = frames - 1; i >= 0; --i) {
+			for (c = channels - 1; c >= 2; --c)
+				buf[i * channels + c] = 0;
+			buf[i * channels + 1] = buf[2 * i + 1];
+			buf[i * channels] = buf[2 * i];
+		}
+	}
+}
+
+/**
+ * Make room in state.conv for \p frames frames of the resampler's stereo,
+ * or of the device's channels if wider
+ */
+static void alsa_conv_reserve(int frames)
+{
+	int n = frames * (state.channels > 2 ? state.channels : 2);
+
+	if (n > state.conv_cap) {
+		state.conv_cap = n;
+		state.conv = realloc(state.conv, sizeof(audio_fifo_data_t) + n * sizeof(int16_t));
+	}
+}
+
+/**
+ * Convert \p afd to the device format, if it isn't in it already. The
+ * result stays valid until the next call.
+ *
+ * A new track first flushes what the resampler still holds of the last
+ * one, so its final frames are played rather than dropped.
+ */
+static audio_fifo_data_t *alsa_convert(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int64_t t;
+	int n, d = 0;
+
+	if ((afd->flags & AUDIO_TRACK_START) && state.rs.taps &&
+	    state.rs.out_rate == state.rate) {
+		alsa_conv_reserve(resampler_max_out(&state.rs, state.rs.taps));
+		d = resampler_drain(&state.rs, state.conv->samples);
+	}
+
+	if (!d && afd->rate == state.rate && afd->channels == state.channels)
+		return afd;
+
+	t = audio_now_us();
+
+	if (afd->rate == state.rate && afd->channels == state.channels) {
+		/* Already in the device format, it only goes after the tail */
+		alsa_conv_reserve(d + afd->nsamples);
+		alsa_remap(state.conv->samples, d, state.channels);
+		memcpy(state.conv->samples + d * state.channels, afd->samples,
+		       afd->nsamples * state.channels * sizeof(int16_t));
+		n = afd->nsamples;
+	} else {
+		if (state.rs.in_rate != afd->rate || state.rs.out_rate != state.rate) {
+			if (resampler_init(&state.rs, afd->rate, state.rate, af->quality) < 0) {
+				fprintf(stderr, "Unable to resample %d Hz to %d Hz, dying\n",
+				        afd->rate, state.rate);
+				exit(1);
+			}
+		}
+
+		alsa_conv_reserve(d + resampler_max_out(&state.rs, afd->nsamples));
+		n = resampler_process(&state.rs, afd->samples, afd->nsamples,
+		                      afd->channels, state.conv->samples + d * 2);
+		alsa_remap(state.conv->samples, d + n, state.channels);
+	}
+
+	state.conv_us += audio_now_us() - t;
+	state.conv_frames += d + n;
+
+	state.conv->nsamples = d + n;
+	state.conv->rate = state.rate;
+	state.conv->channels = state.channels;
+	state.conv->flags = afd->flags;
+	state.conv->start_ms = afd->start_ms;
+	state.conv->pool = -1;
+
+	audio_fifo_free(af, afd);
+	return state.conv;
+}
+
+/**
+ * Take the next chunk from the fifo, converted to the device format unless
+ * its format calls for reopening the device first.
+ */
+static audio_fifo_data_t *alsa_next(audio_fifo_t *af)
+{
+	audio_fifo_data_t *afd;
+
+	/* Just resumed, what pausing took back goes first */
+	if ((afd = TAILQ_FIRST(&state.carry))) {
+		TAILQ_REMOVE(&state.carry, afd, link);
+		return afd;
+	}
+
+	if (state.next) {
+		afd = state.next;
+		state.next = NULL;
+		return afd;
+	}
+
+	afd = audio_tryget(af);
+
+	if (!afd)
 		return NULL;
+
+	state.chunks++;
+
+	if (!state.h || (!af->out_rate && (afd->rate != state.in_rate ||
+	                                   afd->channels != state.in_channels)))
+		return afd;
+
+	return alsa_convert(af, afd);
+}
+
+static void alsa_release(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	if (afd != state.conv)
+		audio_fifo_free(af, afd);
+}
+
+/**
+ * Copy up to \p frames frames from the fifo to \p dst, across as many
+ * chunks as it takes. Stops early at a format change, or when the fifo has
+ * nothing more right now.
+ *
+ * @return Frames copied
+ */
+static int alsa_fill(audio_fifo_t *af, int16_t *dst, int frames)
+{
+	audio_fifo_data_t *afd;
+	int n, done = 0;
+
+	while (done < frames) {
+		if (!state.cur) {
+			afd = alsa_next(af);
+
+			if (!afd)
+				break;
+
+			/* New audio must not follow what the flush is about to drop */
+			if (state.want_flush) {
+				state.next = afd;
+				break;
+			}
+
+			state.cur = afd;
+			state.pos = 0;
+		}
+
+		if (state.cur->rate != state.rate || state.cur->channels != state.channels)
+			break;
+
+		if (!state.pos)
+			audio_clock_anchor(af, state.cur, done);
+
+		n = state.cur->nsamples - state.pos;
+		if (n > frames - done)
+			n = frames - done;
+
+		memcpy(dst + done * state.channels,
+		       state.cur->samples + state.pos * state.channels,
+		       n * state.channels * sizeof(int16_t));
+
+		done += n;
+		state.pos += n;
+
+		if (state.pos == state.cur->nsamples) {
+			alsa_release(af, state.cur);
+			state.cur = NULL;
+		}
 	}
 
-	return h;
+	return done;
 }
 
-static void* alsa_audio_start(void *aux)
+/**
+ * Record an xrun or suspend reported as \p err by a device call and get
+ * the device going again.
+ */
+static void alsa_xrun(audio_fifo_t *af, int err)
 {
-	audio_fifo_t *af = aux;
-	snd_pcm_t *h = NULL;
+	int64_t now = audio_now_us();
+	int limit = af->xrun_limit ? af->xrun_limit : XRUN_LIMIT;
+	int64_t prev;
+	int r;
+
+	if (limit > XRUN_HISTORY)
+		limit = XRUN_HISTORY;
+
+	if (err == -EPIPE) {
+		prev = state.xruns ? state.xrun_us[(state.xruns - 1) % XRUN_HISTORY] : 0;
+		state.xrun_us[state.xruns++ % XRUN_HISTORY] = now;
+		state.interval_xruns++;
+		state.calm_us = now;
+
+		/* The timer woke too late, wake earlier from now on */
+		if (state.tsched && state.watermark_ms * 2 * state.rate / 1000 <= state.buffer_size / 2) {
+			state.watermark_ms *= 2;
+			fprintf(stderr, "audio: timer watermark raised to %d ms\n", state.watermark_ms);
+		}
+
+		if (prev)
+			fprintf(stderr, "audio: xrun #%d, %d ms after the previous one\n",
+			        state.xruns, (int)((now - prev) / 1000));
+		else
+			fprintf(stderr, "audio: xrun #%d\n", state.xruns);
+
+		/* Too many too close together, and not just the ones that caused the last growth */
+		if (limit > 0 && state.xruns >= limit &&
+		    now - state.xrun_us[(state.xruns - limit) % XRUN_HISTORY] < XRUN_WINDOW_MS * 1000LL &&
+		    state.xrun_us[(state.xruns - limit) % XRUN_HISTORY] > state.grown_us)
+			state.want_grow = 1;
+	} else if (err == -ESTRPIPE) {
+		if (state.suspends++)
+			fprintf(stderr, "audio: device suspended (#%d, %d s after the previous one), resuming\n",
+			        state.suspends, (int)((now - state.suspend_us) / 1000000));
+		else
+			fprintf(stderr, "audio: device suspended, resuming\n");
+		state.suspend_us = now;
+	}
+
+	r = snd_pcm_recover(state.h, err, 1);
+
+	if (r < 0) {
+		fprintf(stderr, "audio: Unable to recover from %s (%s), dropping\n",
+		        snd_strerror(err), snd_strerror(r));
+		snd_pcm_drop(state.h);
+		snd_pcm_prepare(state.h);
+	}
+}
+
+/**
+ * Assemble up to \p frames frames straight in the device buffer through
+ * snd_pcm_mmap_begin/commit.
+ *
+ * @return Frames written, or a negative error code
+ */
+static snd_pcm_sframes_t alsa_mmap_write(audio_fifo_t *af, snd_pcm_uframes_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, n, done = 0;
+	snd_pcm_sframes_t r = 0;
+	int16_t *dst;
 	int c;
-	int cur_channels = 0;
-	int cur_rate = 0;
 
+	state.busy = 1;
+
+	while (done < frames) {
+		n = frames - done;
+		r = snd_pcm_mmap_begin(state.h, &areas, &offset, &n);
+		if (r < 0)
+			break;
+
+		dst = (int16_t *)((char *)areas[0].addr + areas[0].first / 8 +
+		                  offset * (areas[0].step / 8));
+		c = alsa_fill(af, dst, n);
+		if (!c)
+			break;
+
+		r = snd_pcm_mmap_commit(state.h, offset, c);
+		if (r < 0)
+			break;
+
+		audio_clock_wrote(af, r);
+		state.writes++;
+		done += r;
+
+		if (c < n)
+			break;
+	}
+
+	state.busy = 0;
+
+	if (r < 0)
+		return r;
+
+	if (done && snd_pcm_state(state.h) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(state.h);
+
+	return done;
+}
+
+/**
+ * Assemble up to \p frames frames in the staging buffer and hand them to
+ * the device with snd_pcm_writei(). A non-blocking device may take only
+ * part of them; the rest stays staged and goes out first next time.
+ *
+ * @return Frames written, or a negative error code
+ */
+static snd_pcm_sframes_t alsa_rw_write(audio_fifo_t *af, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t r = 0;
+	int done = 0;
+
+	if (!state.staged) {
+		state.busy = 1;
+		state.staged = alsa_fill(af, state.stage, frames);
+		state.stage_pos = 0;
+		state.busy = 0;
+	}
+
+	while (state.stage_pos < state.staged) {
+		r = snd_pcm_writei(state.h, state.stage + state.stage_pos * state.channels,
+		                   state.staged - state.stage_pos);
+		state.writes++;
+
+		/* Full after all, back to poll() */
+		if (r == -EAGAIN)
+			break;
+
+		if (r == -EPIPE || r == -ESTRPIPE || r == -EINTR) {
+			alsa_xrun(af, r);
+			continue;
+		}
+
+		if (r < 0) {
+			state.staged = 0;
+			return r;
+		}
+
+		audio_clock_wrote(af, r);
+		state.stage_pos += r;
+		done += r;
+	}
+
+	if (state.stage_pos == state.staged)
+		state.staged = 0;
+
+	return done;
+}
+
+/**
+ * Log device writes against fifo chunks every ten seconds. Without
+ * coalescing there would be one write per chunk.
+ */
+static void alsa_stats(void)
+{
+	int64_t now = audio_now_us();
+	int64_t t = now - state.stats_us;
+
+	if (t < 10000000)
+		return;
+
+	fprintf(stderr, "audio: %d writes/s for %d chunks/s (period %lu frames)\n",
+	        (int)(state.writes * 1000000LL / t), (int)(state.chunks * 1000000LL / t),
+	        state.period_size);
+
+	if (state.tsched)
+		fprintf(stderr, "audio: %.2f wakeups/s on the timer, watermark %d ms of %d ms, "
+		        "period wakeups %s\n", state.wakeups * 1000000.0 / t,
+		        state.watermark_ms,
+		        state.rate ? (int)(state.buffer_size * 1000 / state.rate) : 0,
+		        state.nowake ? "off" : "still on in the hardware");
+	else
+		fprintf(stderr, "audio: %.2f wakeups/s on periods\n", state.wakeups * 1000000.0 / t);
+
+	fprintf(stderr, "audio: %d xruns in the interval, %d xruns and %d suspends in total, "
+	        "buffer %lu frames (%d ms)\n", state.interval_xruns, state.xruns, state.suspends,
+	        state.buffer_size, state.rate ? (int)(state.buffer_size * 1000 / state.rate) : 0);
+
+	if (state.conv_frames)
+		fprintf(stderr, "audio: resampling %d Hz to %d Hz (%s), %.2f ms CPU per second of audio\n",
+		        state.rs.in_rate, state.rs.out_rate, resampler_preset_name(state.rs.quality),
+		        state.conv_us / 1000.0 * state.rate / state.conv_frames);
+
+	state.stats_us = now;
+	state.writes = 0;
+	state.chunks = 0;
+	state.interval_xruns = 0;
+	state.wakeups = 0;
+	state.conv_us = 0;
+	state.conv_frames = 0;
+}
+
+/**
+ * Give back the chunks alsa_carry_reserve() set aside
+ */
+static void alsa_kept_free(audio_fifo_t *af)
+{
 	audio_fifo_data_t *afd;
 
-	for (;;) {
-		afd = audio_get(af);
+	while ((afd = TAILQ_FIRST(&state.kept))) {
+		TAILQ_REMOVE(&state.kept, afd, link);
+		audio_fifo_free(af, afd);
+	}
+}
 
-		if (!h || cur_rate != afd->rate || cur_channels != afd->channels) {
-			if (h) snd_pcm_close(h);
+/**
+ * Drop what pausing took back
+ */
+static void alsa_carry_free(audio_fifo_t *af)
+{
+	audio_fifo_data_t *afd;
 
-			cur_rate = afd->rate;
-			cur_channels = afd->channels;
+	while ((afd = TAILQ_FIRST(&state.carry))) {
+		TAILQ_REMOVE(&state.carry, afd, link);
+		alsa_release(af, afd);
+	}
+}
 
-			h = alsa_open("default", cur_rate, cur_channels);
+/**
+ * Set aside pool chunks in state.kept for \p frames frames, before anything
+ * is taken back from the device.
+ *
+ * @return 0 on success, -1 if the pool ran out
+ */
+static int alsa_carry_reserve(audio_fifo_t *af, int frames)
+{
+	audio_fifo_data_t *afd;
 
-			if (!h) {
-				fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
-				        cur_channels, cur_rate);
-				exit(1);
-			}
+	for (; frames > 0; frames -= afd->nsamples) {
+		if (!(afd = audio_fifo_alloc(af, frames, state.channels))) {
+			alsa_kept_free(af);
+			return -1;
 		}
 
-		c = snd_pcm_wait(h, 1000);
+		afd->rate = state.rate;
+		TAILQ_INSERT_TAIL(&state.kept, afd, link);
+	}
+
+	return 0;
+}
 
-		if (c >= 0)
-			c = snd_pcm_avail_update(h);
+/**
+ * Copy the frames of the device ring from \p offset on into state.kept,
+ * followed by what is left of the current chunk, and put them in front of
+ * state.carry to be played on resume.
+ */
+static void alsa_carry(audio_fifo_t *af, const snd_pcm_channel_area_t *areas,
+                       snd_pcm_uframes_t offset, int frames)
+{
+	const int16_t *ring = (const int16_t *)((char *)areas[0].addr + areas[0].first / 8);
+	audio_fifo_data_t *afd, *t;
+	int i, n;
 
-		if (c == -EPIPE)
-			snd_pcm_prepare(h);
+	for (afd = TAILQ_FIRST(&state.kept); afd; afd = t) {
+		t = TAILQ_NEXT(afd, link);
 
-		snd_pcm_writei(h, afd->samples, afd->nsamples);
-		free(afd);
+		if (!frames) {
+			/* The device gave back less than was reserved */
+			TAILQ_REMOVE(&state.kept, afd, link);
+			audio_fifo_free(af, afd);
+			continue;
+		}
+
+		if (afd->nsamples > frames)
+			afd->nsamples = frames;
+
+		for (i = 0; i < afd->nsamples; i += n) {
+			offset %= state.buffer_size;
+			n = state.buffer_size - offset;
+			if (n > afd->nsamples - i)
+				n = afd->nsamples - i;
+
+			memcpy(afd->samples + i * state.channels, ring + offset * state.channels,
+			       n * state.channels * sizeof(int16_t));
+			offset += n;
+		}
+
+		frames -= afd->nsamples;
+	}
+
+	if (state.cur) {
+		/* A chunk waiting for the device to be reopened is left whole */
+		if (state.pos) {
+			memmove(state.cur->samples,
+			        state.cur->samples + state.pos * state.cur->channels,
+			        (state.cur->nsamples - state.pos) * state.cur->channels * sizeof(int16_t));
+			state.cur->nsamples -= state.pos;
+			state.cur->flags = 0;
+			state.pos = 0;
+		}
+
+		TAILQ_INSERT_TAIL(&state.kept, state.cur, link);
+		state.cur = NULL;
+	}
+
+	/* Paused again before all of the last carry was played, it goes after */
+	while ((afd = TAILQ_FIRST(&state.carry))) {
+		TAILQ_REMOVE(&state.carry, afd, link);
+		TAILQ_INSERT_TAIL(&state.kept, afd, link);
+	}
+
+	while ((afd = TAILQ_FIRST(&state.kept))) {
+		TAILQ_REMOVE(&state.kept, afd, link);
+		TAILQ_INSERT_TAIL(&state.carry, afd, link);
 	}
 }
 
-void audio_init(audio_fifo_t *af)
+/**
+ * Take back what the device has not played yet, except for the next \p ms,
+ * and fade those out in place so stopping does not click. With \p keep set
+ * the frames taken back are saved in state.carry.
+ *
+ * @return 0 on success, -1 if the device can't rewind or the pool has no
+ *         room to keep what it would take back
+ */
+static int alsa_fade_out(audio_fifo_t *af, int keep, int ms)
 {
-	pthread_t tid;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, n;
+	snd_pcm_sframes_t r, ramp = state.rate * ms / 1000;
+	int16_t *dst;
+	int done = 0;
 
-	TAILQ_INIT(&af->q);
-	af->qlen = 0;
+	if (!state.mmap)
+		return -1;
 
-	pthread_mutex_init(&af->mutex, NULL);
-	pthread_cond_init(&af->cond, NULL);
+	r = snd_pcm_rewindable(state.h) - state.rate * GUARD_MS / 1000;
+	if (r <= 0)
+		return -1;
 
-	pthread_create(&tid, NULL, alsa_audio_start, af);
+	/* Without room to keep them, the frames had better stay in the device */
+	if (keep && alsa_carry_reserve(af, r > ramp ? r - ramp : 0) < 0)
+		return -1;
+
+	if ((r = snd_pcm_rewind(state.h, r)) <= 0) {
+		alsa_kept_free(af);
+		return -1;
+	}
+
+	audio_clock_wrote(af, -r);
+
+	if (ramp > r)
+		ramp = r;
+
+	if (keep) {
+		n = r;
+		if (snd_pcm_mmap_begin(state.h, &areas, &offset, &n) < 0) {
+			alsa_kept_free(af);
+			return -1;
+		}
+
+		alsa_carry(af, areas, offset + ramp, r - ramp);
+	}
+
+	while (done < ramp) {
+		n = ramp - done;
+		if (snd_pcm_mmap_begin(state.h, &areas, &offset, &n) < 0)
+			return -1;
+
+		/* The rewound frames are still in the buffer, fade them where they are */
+		dst = (int16_t *)((char *)areas[0].addr + areas[0].first / 8 +
+		                  offset * (areas[0].step / 8));
+		dsp_ramp(dst, n, state.channels, DSP_UNITY * (ramp - done) / ramp,
+		         DSP_UNITY * (ramp - done - (int)n) / ramp);
+
+		snd_pcm_mmap_commit(state.h, offset, n);
+		audio_clock_wrote(af, n);
+		done += n;
+	}
+
+	return 0;
 }
 
-void audio_fifo_flush(audio_fifo_t *af)
+/**
+ * Play out what the device holds. snd_pcm_drain() would return -EAGAIN
+ * straight away on a non-blocking handle, so this one blocks.
+ */
+static void alsa_drain(void)
+{
+	if (state.nonblock)
+		snd_pcm_nonblock(state.h, 0);
+
+	snd_pcm_drain(state.h);
+
+	if (state.nonblock)
+		snd_pcm_nonblock(state.h, 1);
+}
+
+/**
+ * Tell the playback clock how much the device has left to play.
+ */
+static void alsa_clock(audio_fifo_t *af, int running)
+{
+	snd_pcm_sframes_t delay;
+
+	if (snd_pcm_delay(state.h, &delay) < 0)
+		delay = 0;
+
+	audio_clock_sync(af, delay, running);
+}
+
+/**
+ * Set the device up for a stream of \p rate and \p channels, opening it
+ * the first time. A format change keeps the handle: the old format plays
+ * out, the hardware parameters are freed and the new ones applied, along
+ * with any buffer size alsa_adapt() asked for.
+ */
+static void alsa_reconfigure(audio_fifo_t *af, int rate, int channels)
+{
+	int64_t t = audio_now_us();
+	snd_pcm_uframes_t from = state.buffer_size;
+	int r;
+
+	if (!state.h) {
+		state.h = alsa_open(state.device);
+	} else {
+		alsa_drain();
+		snd_pcm_hw_free(state.h);
+	}
+
+	state.in_rate = rate;
+	state.in_channels = channels;
+
+	if (af->out_rate) {
+		rate = af->out_rate;
+		channels = 2;
+	}
+
+	if (!state.h || (r = alsa_configure(rate, channels)) < 0) {
+		fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
+		        channels, rate);
+		exit(1);
+	}
+
+	if (!state.base_buffer)
+		state.base_buffer = state.buffer_size;
+
+	/* The fifo holds the same extra depth as the device */
+	af->xrun_ms = 0;
+	if (state.buffer_size > state.base_buffer)
+		af->xrun_ms = (state.buffer_size - state.base_buffer) * 1000 / state.rate;
+	if (af->xrun_ms > AUDIO_XRUN_MAX_MS)
+		af->xrun_ms = AUDIO_XRUN_MAX_MS;
+
+	audio_clock_rate(af, state.rate);
+
+	fprintf(stderr, "audio: configured for %d Hz, %d channels in %d ms (%s)\n",
+	        state.rate, state.channels, (int)((audio_now_us() - t) / 1000),
+	        r ? "cached" : "negotiated");
+
+	if (state.want_resize) {
+		state.want_resize = 0;
+		state.calm_us = state.grown_us = audio_now_us();
+
+		fprintf(stderr, "audio: %s buffer from %lu to %lu frames (%d ms), fifo %+d ms\n",
+		        state.buffer_size > from ? "grew" : "shrank", from, state.buffer_size,
+		        (int)(state.buffer_size * 1000 / state.rate), af->xrun_ms);
+	}
+}
+
+/**
+ * Apply a pending buffer size. Call only once the device holds nothing
+ * more to play: after a flush, on pause, or once alsa_adapt() has taken
+ * the audio back. A device paused in place still holds its audio, so the
+ * size waits.
+ */
+static void alsa_resize(audio_fifo_t *af)
+{
+	if (!state.want_resize || snd_pcm_state(state.h) == SND_PCM_STATE_PAUSED)
+		return;
+
+	alsa_reconfigure(af, state.in_rate, state.in_channels);
+}
+
+/**
+ * Act on flushes and pauses the fifo has reported, unless a device write
+ * is in progress, in which case alsa_audio_start() calls again after it.
+ */
+static void alsa_transport(audio_fifo_t *af)
 {
 	audio_fifo_data_t *afd;
+	snd_pcm_sframes_t delay;
+	int n;
+
+	if (state.busy)
+		return;
+
+	if (!state.h) {
+		state.want_flush = 0;
+		return;
+	}
+
+	if (state.want_flush) {
+		state.want_flush = 0;
+
+		if (alsa_fade_out(af, 0, FADE_MS) < 0) {
+			/* What the device held is never heard */
+			if (snd_pcm_delay(state.h, &delay) == 0)
+				audio_clock_wrote(af, -delay);
+			snd_pcm_drop(state.h);
+			snd_pcm_prepare(state.h);
+		}
+
+		alsa_carry_free(af);
+
+		/* The filter history belongs to the old position */
+		resampler_reset(&state.rs);
+
+		state.staged = 0;
+
+		/* Flushed while waiting for the device, the chunk in hand is stale */
+		if (state.cur) {
+			alsa_release(af, state.cur);
+			state.cur = NULL;
+		}
+
+		/* Only the fade is left in the device, a pending resize can go now */
+		if (state.want_resize && snd_pcm_state(state.h) != SND_PCM_STATE_PAUSED) {
+			alsa_drain();
+			alsa_resize(af);
+		}
+
+		state.probe = 1;
+	}
+
+	if (state.want_pause == state.paused)
+		return;
+
+	state.paused = state.want_pause;
+
+	if (state.paused) {
+		/* Let the fade play out, then stop */
+		if (alsa_fade_out(af, 1, FADE_MS) == 0)
+			alsa_drain();
+		else if (snd_pcm_pause(state.h, 1) < 0)
+			snd_pcm_drop(state.h);
+
+		alsa_clock(af, 0);
+		alsa_resize(af);
+
+		fprintf(stderr, "audio: paused %u ms after the command\n",
+		        audio_fifo_since_press(af));
+		return;
+	}
+
+	if (snd_pcm_state(state.h) == SND_PCM_STATE_PAUSED) {
+		snd_pcm_pause(state.h, 0);
+	} else {
+		snd_pcm_prepare(state.h);
+
+		/* alsa_next() plays what pausing took back first, fading it in */
+		if ((afd = TAILQ_FIRST(&state.carry))) {
+			n = state.rate * FADE_MS / 1000;
+			if (n > afd->nsamples)
+				n = afd->nsamples;
+
+			dsp_ramp(afd->samples, n, afd->channels, 0, DSP_UNITY);
+		}
+	}
 
-	pthread_mutex_lock(&af->mutex);
+	state.probe = 1;
+}
+
+/**
+ * Log how long the last transport command took to be heard: the time until
+ * its first audio was written plus what the device had queued before it.
+ */
+static void alsa_probe(audio_fifo_t *af)
+{
+	snd_pcm_sframes_t delay = 0;
+	unsigned int ms = audio_fifo_since_press(af);
+
+	state.probe = 0;
+
+	if (snd_pcm_delay(state.h, &delay) < 0)
+		delay = 0;
+
+	fprintf(stderr, "audio: %u ms from transport command to new audio "
+	        "(%u ms to first write, %d ms queued in the device)\n",
+	        ms + (unsigned int)(delay * 1000 / state.rate), ms,
+	        (int)(delay * 1000 / state.rate));
+}
+
+/**
+ * Fifo hooks. Both run on the driver thread from within audio_get() or
+ * audio_tryget().
+ */
+static void alsa_pause(int pause)
+{
+	state.want_pause = pause;
+	alsa_transport(state.af);
+}
+
+static void alsa_flush(void)
+{
+	state.want_flush = 1;
+	alsa_transport(state.af);
+}
+
+/**
+ * Grow the device buffer after a burst of xruns, and give the growth back
+ * once the device has been quiet for a while.
+ *
+ * Draining the device first would stall the thread for the whole buffer.
+ * Instead what it has queued is taken back into state.carry and played
+ * again after the resize. Where that is not possible the new size waits
+ * for the next flush, pause or format change.
+ */
+static void alsa_adapt(audio_fifo_t *af)
+{
+	snd_pcm_uframes_t from = state.buffer_size, size;
+
+	if (state.want_resize)
+		return;
+
+	if (state.want_grow) {
+		state.want_grow = 0;
+		size = from * 2;
+		if (size > state.base_buffer * XRUN_MAX_GROWTH) {
+			fprintf(stderr, "audio: xruns continue at the largest buffer (%lu frames)\n", from);
+			return;
+		}
+	} else if (from > state.base_buffer &&
+	           audio_now_us() - state.calm_us > XRUN_STABLE_MS * 1000LL) {
+		size = from / 2;
+		if (size < state.base_buffer)
+			size = state.base_buffer;
+	} else {
+		return;
+	}
+
+	state.want_buffer = size;
+	state.want_resize = 1;
 
-	while((afd = TAILQ_FIRST(&af->q))) {
-		TAILQ_REMOVE(&af->q, afd, link);
-		free(afd);
+	/* Only the guard is left to play out, which is over in a moment */
+	if (snd_pcm_state(state.h) == SND_PCM_STATE_RUNNING) {
+		if (alsa_fade_out(af, 1, 0) < 0) {
+			fprintf(stderr, "audio: buffer change to %lu frames waits for a pause or "
+			        "track change\n", size);
+			return;
+		}
+
+		alsa_drain();
 	}
 
-	af->qlen = 0;
-	pthread_mutex_unlock(&af->mutex);
+	alsa_resize(af);
 }
 
+/**
+ * Sleep until the fifo signals and, with \p device set, until the device
+ * can take more, or for at most \p timeout ms.
+ *
+ * @return What poll() returned
+ */
+static int alsa_wait(int device, int timeout)
+{
+	unsigned short revents;
+	int r, n = 1;
+
+	if (device) {
+		snd_pcm_poll_descriptors(state.h, state.pfd + 1, state.npfd);
+		n += state.npfd;
+	}
+
+	r = poll(state.pfd, n, timeout);
+	state.wakeups++;
+
+	if (r > 0 && device)
+		snd_pcm_poll_descriptors_revents(state.h, state.pfd + 1, state.npfd, &revents);
+
+	return r;
+}
+
+/**
+ * Sleep until the fifo signals or for \p frames worth of playback, on the
+ * timer rather than the device's descriptors. Timer scheduling only.
+ *
+ * @return What poll() returned, with the fifo's revents in state.pfd[0]
+ */
+static int alsa_sleep(snd_pcm_sframes_t frames)
+{
+	struct itimerspec its;
+	struct pollfd pfd[2];
+	int64_t ns = frames * 1000000000LL / state.rate;
+	uint64_t expired;
+	int r;
+
+	/* A zero it_value would disarm the timer */
+	if (ns < 1)
+		ns = 1;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	timerfd_settime(state.tfd, 0, &its, NULL);
+
+	pfd[0] = state.pfd[0];
+	pfd[1].fd = state.tfd;
+	pfd[1].events = POLLIN;
+
+	r = poll(pfd, 2, -1);
+	state.wakeups++;
+
+	/* Nonblocking, a spurious wakeup simply finds nothing to read */
+	if (r > 0 && (pfd[1].revents & POLLIN))
+		if (read(state.tfd, &expired, sizeof(expired)) < 0)
+			expired = 0;
+
+	state.pfd[0].revents = pfd[0].revents;
+	return r;
+}
+
+/**
+ * The driver thread. It never blocks in audio_get(): one poll() covers both
+ * the fifo's eventfd and the device, so flushes, pauses and shutdown are
+ * handled as they happen, even while waiting for the device to drain.
+ */
+static void* alsa_audio_start(void *aux)
+{
+	audio_fifo_t *af = aux;
+	snd_pcm_sframes_t avail, delay, wm;
+	snd_pcm_sframes_t r;
+	snd_pcm_state_t pcm_state;
+	int paused, timeout;
+
+	state.stats_us = audio_now_us();
+
+	while (!af->shutdown) {
+		paused = audio_fifo_control(af);
+
+		if (!paused && !state.cur) {
+			state.cur = alsa_next(af);
+			state.pos = 0;
+		}
+
+		if (paused || (!state.cur && !state.staged)) {
+			/* Nothing to play, sleep on the fifo alone */
+			timeout = audio_fifo_arm(af);
+			r = timeout ? alsa_wait(0, timeout) : 1;
+			audio_fifo_disarm(af, r == 0);
+			continue;
+		}
+
+		/* Whatever is staged was meant for the current format, write it first */
+		if (!state.staged && (!state.h || state.rate != state.cur->rate ||
+		                      state.channels != state.cur->channels)) {
+			/* With a fixed output format the device is only configured once */
+			if (!state.h || !af->out_rate)
+				alsa_reconfigure(af, state.cur->rate, state.cur->channels);
+
+			state.cur = alsa_convert(af, state.cur);
+		}
+
+		avail = snd_pcm_avail_update(state.h);
+
+		if (avail < 0) {
+			alsa_xrun(af, avail);
+			continue;
+		}
+
+		if (state.tsched) {
+			pcm_state = snd_pcm_state(state.h);
+
+			if (!avail && pcm_state == SND_PCM_STATE_PREPARED) {
+				snd_pcm_start(state.h);
+				continue;
+			}
+
+			/*
+			 * Sleep while more than the watermark is queued, then top it
+			 * all up. A full buffer is the steady state here, so that
+			 * sleeps too rather than polling avail.
+			 */
+			wm = state.watermark_ms * state.rate / 1000;
+			if (pcm_state == SND_PCM_STATE_RUNNING && snd_pcm_delay(state.h, &delay) == 0) {
+				if (delay > wm || !avail) {
+					if (alsa_sleep(delay > wm ? delay - wm : state.period_size) > 0 &&
+					    state.pfd[0].revents)
+						audio_fifo_disarm(af, 0);
+					continue;
+				}
+			} else if (!avail) {
+				/* No delay to sleep on, wait on the device instead */
+				if (alsa_wait(1, 1000) > 0 && state.pfd[0].revents)
+					audio_fifo_disarm(af, 0);
+				continue;
+			}
+		} else if (avail < state.period_size) {
+			/* Sleep until at least a period is free, then fill whole periods */
+			if (snd_pcm_state(state.h) == SND_PCM_STATE_PREPARED)
+				snd_pcm_start(state.h);
+			else if (alsa_wait(1, 1000) > 0 && state.pfd[0].revents)
+				audio_fifo_disarm(af, 0);
+			continue;
+		} else {
+			avail -= avail % state.period_size;
+		}
+
+		if (state.mmap)
+			r = alsa_mmap_write(af, avail);
+		else
+			r = alsa_rw_write(af, avail);
+
+		if (r < 0)
+			alsa_xrun(af, r);
+		else if (r > 0)
+			alsa_clock(af, 1);
+
+		if (r > 0 && state.probe)
+			alsa_probe(af);
+
+		alsa_transport(af);
+
+		alsa_adapt(af);
+		alsa_stats();
+	}
+
+	if (state.h) {
+		snd_pcm_drop(state.h);
+		snd_pcm_close(state.h);
+		state.h = NULL;
+	}
+
+	af->shutdown = 2;
+	return NULL;
+}
+
+/* -----------------------------  CALIBRATION  ----------------------------- */
+/**
+ * Put the per-user profile path in \p path, making its directories first
+ * if \p create is set.
+ *
+ * @return 0 on success, -1 if there is no home directory to put it in
+ */
+static int alsa_profile_path(char *path, size_t size, int create)
+{
+	const char *base = getenv("XDG_CONFIG_HOME");
+	const char *home = getenv("HOME");
+
+	if (base && *base)
+		snprintf(path, size, "%s/" PROFILE_DIR, base);
+	else if (home && *home)
+		snprintf(path, size, "%s/.config/" PROFILE_DIR, home);
+	else
+		return -1;
+
+	if (create) {
+		/* Only the last two levels can be missing */
+		*strrchr(path, '/') = '\0';
+		mkdir(path, 0700);
+		path[strlen(path)] = '/';
+		mkdir(path, 0700);
+	}
+
+	snprintf(path + strlen(path), size - strlen(path), "/" PROFILE_NAME);
+	return 0;
+}
+
+/**
+ * Read the profile saved by the last calibration.
+ *
+ * @return 0 if there was one
+ */
+static int alsa_load_profile(char *device, snd_pcm_uframes_t *period,
+                             snd_pcm_uframes_t *buffer)
+{
+	char path[PATH_MAX];
+	unsigned long p = 0, b = 0;
+	FILE *fp;
+	int r;
+
+	if (alsa_profile_path(path, sizeof(path), 0) < 0 || !(fp = fopen(path, "r")))
+		return -1;
+
+	r = fscanf(fp, "%127s %lu %lu", device, &p, &b) == 3 ? 0 : -1;
+	fclose(fp);
+
+	/* A truncated profile leaves the caller's sizes alone */
+	if (r < 0)
+		return r;
+
+	*period = p;
+	*buffer = b;
+	return 0;
+}
+
+/**
+ * Save the calibrated setup for the next start, and say where
+ */
+static void alsa_save_profile(void)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	if (alsa_profile_path(path, sizeof(path), 1) < 0) {
+		fprintf(stderr, "calibrate: no home directory, profile not saved\n");
+		return;
+	}
+
+	fp = fopen(path, "w");
+
+	if (!fp) {
+		perror(path);
+		return;
+	}
+
+	fprintf(fp, "%s %lu %lu\n", state.device, state.want_period, state.want_buffer);
+	fclose(fp);
+
+	fprintf(stderr, "calibrate: saved to %s\n", path);
+}
+
+static double cpu_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Feed silence to the configured device for CALIBRATE_MS, a period at a
+ * time as the driver thread would.
+ *
+ * @return Number of xruns
+ */
+static int alsa_calibrate_run(double *cpu)
+{
+	int16_t *silence = calloc(state.period_size, state.channels * sizeof(int16_t));
+	int64_t end = audio_now_us() + CALIBRATE_MS * 1000;
+	double t = cpu_ms();
+	snd_pcm_sframes_t r;
+	int xruns = 0;
+
+	while (audio_now_us() < end) {
+		r = snd_pcm_avail_update(state.h);
+
+		if (r >= 0 && r < state.period_size) {
+			if (snd_pcm_state(state.h) == SND_PCM_STATE_PREPARED)
+				snd_pcm_start(state.h);
+			else
+				snd_pcm_wait(state.h, 1000);
+			continue;
+		}
+
+		if (r >= 0) {
+			if (state.mmap)
+				r = snd_pcm_mmap_writei(state.h, silence, state.period_size);
+			else
+				r = snd_pcm_writei(state.h, silence, state.period_size);
+		}
+
+		if (r < 0 && r != -EAGAIN) {
+			++xruns;
+			snd_pcm_prepare(state.h);
+		}
+	}
+
+	*cpu = (cpu_ms() - t) * 1000 / CALIBRATE_MS;
+	free(silence);
+	return xruns;
+}
+
+/**
+ * Fill \p devices with the ways to reach the hardware behind \p name, from
+ * direct access down to \p name itself.
+ *
+ * @return Number of devices
+ */
+static int alsa_calibrate_ladder(const char *name, char devices[][sizeof(state.device)])
+{
+	snd_pcm_info_t *info;
+	snd_pcm_t *h;
+	int card = -1, dev = 0, n = 0;
+
+	snd_pcm_info_alloca(&info);
+
+	if ((h = alsa_open(name))) {
+		if (snd_pcm_info(h, info) == 0) {
+			card = snd_pcm_info_get_card(info);
+			dev = snd_pcm_info_get_device(info);
+		}
+		snd_pcm_close(h);
+	}
+
+	/* Plugins without a card behind them, like a sound server, only have themselves */
+	if (card >= 0) {
+		snprintf(devices[n++], sizeof(state.device), "hw:%d,%d", card, dev);
+		snprintf(devices[n++], sizeof(state.device), "plughw:%d,%d", card, dev);
+	}
+
+	snprintf(devices[n++], sizeof(state.device), "%s", name);
+	return n;
+}
+
+/**
+ * Try a ladder of devices and period/buffer sizes, from direct access to
+ * the default device's card down to the dmix'ed default, and keep the one
+ * with the lowest latency that ran without xruns. Ties go to the lower CPU
+ * time.
+ */
+static void alsa_calibrate(audio_fifo_t *af)
+{
+	static const int periods[] = { 256, 512, 1024, 2048 };
+	static const int counts[] = { 2, 4 };
+	const int rate = af->out_rate ? af->out_rate : 44100;
+	char devices[3][sizeof(state.device)];
+	char best[sizeof(state.device)] = "";
+	snd_pcm_uframes_t best_period = 0, best_buffer = 0;
+	double cpu, best_cpu = 0;
+	int best_ms = 0;
+	int d, p, c, ms, xruns, ndevices;
+
+	/* With a device given, only its sizes are calibrated */
+	if (af->device) {
+		snprintf(devices[0], sizeof(devices[0]), "%s", af->device);
+		ndevices = 1;
+	} else {
+		ndevices = alsa_calibrate_ladder("default", devices);
+	}
+
+	for (d = 0; d < ndevices; ++d) {
+		snprintf(state.device, sizeof(state.device), "%s", devices[d]);
+
+		/* What one device negotiated says nothing about the next */
+		state.nformats = 0;
+
+		state.h = alsa_open(state.device);
+		if (!state.h) {
+			fprintf(stderr, "calibrate: %s: cannot open\n", state.device);
+			continue;
+		}
+		snd_pcm_close(state.h);
+
+		for (p = 0; p < sizeof(periods) / sizeof(periods[0]); ++p) {
+			for (c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+				state.want_period = periods[p];
+				state.want_buffer = periods[p] * counts[c];
+
+				state.h = alsa_open(state.device);
+				if (!state.h)
+					continue;
+
+				if (alsa_configure(rate, 2) < 0) {
+					snd_pcm_close(state.h);
+					continue;
+				}
+
+				xruns = alsa_calibrate_run(&cpu);
+				ms = state.buffer_size * 1000 / state.rate;
+
+				fprintf(stderr, "calibrate: %-12s period %5lu buffer %5lu (%3d ms): "
+				        "%d xruns, %.2f ms CPU/s\n", state.device, state.period_size,
+				        state.buffer_size, ms, xruns, cpu);
+
+				if (!xruns && (!best[0] || ms < best_ms || (ms == best_ms && cpu < best_cpu))) {
+					strcpy(best, state.device);
+					best_period = state.period_size;
+					best_buffer = state.buffer_size;
+					best_ms = ms;
+					best_cpu = cpu;
+				}
+
+				snd_pcm_drop(state.h);
+				snd_pcm_close(state.h);
+			}
+		}
+	}
+
+	state.h = NULL;
+	state.nformats = 0;
+
+	if (!best[0]) {
+		fprintf(stderr, "calibrate: no configuration ran without xruns, keeping defaults\n");
+		state.want_period = 0;
+		state.want_buffer = 0;
+		snprintf(state.device, sizeof(state.device), "%s", af->device ? af->device : "default");
+		return;
+	}
+
+	strcpy(state.device, best);
+	state.want_period = best_period;
+	state.want_buffer = best_buffer;
+
+	fprintf(stderr, "calibrate: using %s, period %lu, buffer %lu (%d ms)\n",
+	        best, best_period, best_buffer, best_ms);
+	alsa_save_profile();
+}
+
+/**
+ * Pick the device and sizes: command line overrides first, then the saved
+ * profile if it is for the same device, then the defaults.
+ */
+static void alsa_setup(audio_fifo_t *af)
+{
+	char device[sizeof(state.device)];
+	snd_pcm_uframes_t period, buffer;
+
+	snprintf(state.device, sizeof(state.device), "%s", af->device ? af->device : "default");
+	state.nonblock = af->nonblock;
+	state.rw = af->rw;
+	state.tsched = af->tsched;
+	state.watermark_ms = TSCHED_WATERMARK_MS;
+
+	if (af->calibrate)
+		alsa_calibrate(af);
+	else if (!alsa_load_profile(device, &period, &buffer) &&
+	         (!af->device || !strcmp(device, af->device))) {
+		strcpy(state.device, device);
+		state.want_period = period;
+		state.want_buffer = buffer;
+	}
+
+	if (af->period_frames)
+		state.want_period = af->period_frames;
+	if (af->buffer_frames)
+		state.want_buffer = af->buffer_frames;
+
+	if (state.tsched && state.want_buffer)
+		fprintf(stderr, "audio: using %s, timer scheduling, buffer %lu frames\n",
+		        state.device, state.want_buffer);
+	else if (state.tsched)
+		fprintf(stderr, "audio: using %s, timer scheduling, %d ms buffer\n",
+		        state.device, TSCHED_BUFFER_MS);
+	else
+		fprintf(stderr, "audio: using %s, period %lu, buffer %lu frames\n", state.device,
+		        state.want_period ? state.want_period : 1024,
+		        state.want_buffer ? state.want_buffer :
+		        (state.want_period ? state.want_period : 1024) * 4);
+}
+
+/// The device options this driver reads
+const char audio_driver_options[] = "DPbCXNTRQ";
+
+void audio_init(audio_fifo_t *af)
+{
+	pthread_t tid;
+
+	audio_fifo_init(af);
+	af->on_pause = alsa_pause;
+	af->on_flush = alsa_flush;
+	state.af = af;
+	TAILQ_INIT(&state.carry);
+	TAILQ_INIT(&state.kept);
+
+	/* alsa_configure() grows it for the device's descriptors, calibration included */
+	state.pfd = realloc(state.pfd, (state.npfd + 1) * sizeof(struct pollfd));
+	state.pfd[0].fd = audio_fifo_eventfd(af);
+	state.pfd[0].events = POLLIN;
+
+	alsa_setup(af);
+
+	if (state.tsched)
+		state.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+	pthread_create(&tid, NULL, alsa_audio_start, af);
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Checks the ALSA driver's non-blocking write path against the null plugin,
+ * so it runs without sound hardware: "make check".
+ *
+ * The driver is run with -N semantics and RW access on pcm.null, which
+ * would take every write in full. The test is linked with
+ * --wrap=snd_pcm_writei so its writes are cut short and turned away with
+ * -EAGAIN now and then, and what the plugin does accept is recorded. Every
+ * frame put into the fifo has to come out exactly once, in order, and the
+ * playback clock has to account for all of them.
+ */
+
+#include <asoundlib.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "audio.h"
+
+/// Rate and length of the test stream
+#define TEST_RATE 44100
+#define TEST_MS 3000
+#define TEST_FRAMES (TEST_RATE * TEST_MS / 1000)
+/// Frames per simulated libspotify delivery
+#define TEST_DELIVERY 2048
+/// Most frames a wrapped write takes, well short of a period
+#define TEST_SHORT 333
+/// Every so many wrapped writes is refused with -EAGAIN
+#define TEST_AGAIN 4
+
+static audio_fifo_t g_audiofifo;
+
+/* What the plugin accepted, filled in on the driver thread */
+static int16_t g_played[TEST_FRAMES * 2];
+static int g_nplayed;
+static int g_calls, g_shorts, g_again, g_overrun;
+
+extern snd_pcm_sframes_t __real_snd_pcm_writei(snd_pcm_t *h, const void *buf,
+                                               snd_pcm_uframes_t size);
+
+/**
+ * Stands in for snd_pcm_writei() in the driver. Takes at most TEST_SHORT
+ * frames, refuses every TEST_AGAIN-th call, and records what gets through.
+ */
+snd_pcm_sframes_t __wrap_snd_pcm_writei(snd_pcm_t *h, const void *buf,
+                                        snd_pcm_uframes_t size)
+{
+	snd_pcm_sframes_t r;
+
+	if (++g_calls % TEST_AGAIN == 0) {
+		g_again++;
+		return -EAGAIN;
+	}
+
+	if (size > TEST_SHORT) {
+		size = TEST_SHORT;
+		g_shorts++;
+	}
+
+	r = __real_snd_pcm_writei(h, buf, size);
+
+	if (r > 0) {
+		if (g_nplayed + r > TEST_FRAMES) {
+			g_overrun += r;
+		} else {
+			memcpy(g_played + g_nplayed * 2, buf, r * 2 * sizeof(int16_t));
+			g_nplayed += r;
+		}
+	}
+
+	return r;
+}
+
+/**
+ * Frame \p i of the test stream, numbered so a frame played twice, skipped
+ * or out of place shows
+ */
+static void test_frame(int16_t *dst, int i)
+{
+	dst[0] = i & 0x7fff;
+	dst[1] = i >> 15;
+}
+
+/**
+ * Everything put into the fifo is played once and in order, however the
+ * device splits up the writes, and the playback clock ends on the length
+ * of what was put.
+ */
+static int test_driver(void)
+{
+	audio_fifo_t *af = &g_audiofifo;
+	static int16_t buf[TEST_DELIVERY * 2];
+	int16_t want[2];
+	int sent = 0, n, i, pos, last = 0, backwards = 0, wrong = -1;
+
+	af->device = "null";
+	af->nonblock = 1;
+	af->rw = 1;
+	audio_init(af);
+	audio_fifo_mark_track(af);
+
+	/* Like libspotify, back off for a moment when the fifo is full */
+	while (sent < TEST_FRAMES) {
+		n = TEST_FRAMES - sent < TEST_DELIVERY ? TEST_FRAMES - sent : TEST_DELIVERY;
+		for (i = 0; i < n; ++i)
+			test_frame(buf + i * 2, sent + i);
+
+		n = audio_fifo_put(af, buf, n, 2, TEST_RATE);
+		if (!n)
+			usleep(1000);
+		sent += n;
+	}
+
+	/* Let the driver play out, watching the clock run */
+	for (i = 0; i < 5000; ++i) {
+		pos = audio_fifo_position(af, NULL);
+		if (pos < last)
+			backwards++;
+		last = pos;
+
+		if (!af->qlen && g_nplayed == TEST_FRAMES && pos >= TEST_MS - 1)
+			break;
+		usleep(1000);
+	}
+
+	audio_fifo_shutdown(af);
+
+	for (i = 0; i < g_nplayed && wrong < 0; ++i) {
+		test_frame(want, i);
+		if (memcmp(g_played + i * 2, want, sizeof(want)))
+			wrong = i;
+	}
+
+	fprintf(stderr, "test: driver played %d of %d frames in %d writes, %d short, %d EAGAIN\n",
+	        g_nplayed, sent, g_calls, g_shorts, g_again);
+	fprintf(stderr, "test: clock at %d of %d ms, %d steps back, %d queued\n",
+	        last, TEST_MS, backwards, af->qlen);
+
+	if (wrong >= 0) {
+		test_frame(want, wrong);
+		fprintf(stderr, "test: frame %d is %d/%d, expected %d/%d\n", wrong,
+		        g_played[wrong * 2], g_played[wrong * 2 + 1], want[0], want[1]);
+	}
+	if (g_overrun)
+		fprintf(stderr, "test: %d frames more than were put\n", g_overrun);
+
+	/* Without short writes and refusals the resume path was never taken */
+	return (g_nplayed != TEST_FRAMES || g_overrun || wrong >= 0 || !g_shorts ||
+	        !g_again || af->qlen || last < TEST_MS - 1 || last > TEST_MS ||
+	        backwards) ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+
+	if (test_driver() < 0)
+		failed++;
+
+	fprintf(stderr, "test: %s\n", failed ? "FAILED" : "passed");
+	return failed ? 1 : 0;
+}
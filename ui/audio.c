@@ -25,20 +25,1117 @@
  * This file is part of the libspotify examples suite.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
 #include "audio.h"
+#include "dsp.h"
+
+#define SLOT_MASK (AUDIO_FIFO_SLOTS - 1)
+/// Frames mixed at one crossfade gain step
+#define XF_BLOCK 64
+/// Gain changes ramp over 1/GAIN_RAMP seconds
+#define GAIN_RAMP 50
+
+/// Frames per chunk in each size class. libspotify usually delivers 2048.
+static const int pool_frames[AUDIO_POOL_CLASSES] = { 2048, 8192 };
+
+
+int64_t audio_now_us(void)
+{
+#if _POSIX_TIMERS > 0
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/**
+ * Put the consumer to sleep until the wakeup sequence moves past \p seq,
+ * or for at most \p timeout_ms if that is positive.
+ */
+static void fifo_sleep(audio_fifo_t *af, int seq, int timeout_ms)
+{
+	struct timespec ts;
+#ifdef __linux__
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+	syscall(SYS_futex, &af->wake, FUTEX_WAIT_PRIVATE, seq,
+	        timeout_ms > 0 ? &ts : NULL, NULL, 0);
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + timeout_ms / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&af->mutex);
+	while (af->wake == seq) {
+		if (timeout_ms <= 0)
+			pthread_cond_wait(&af->cond, &af->mutex);
+		else if (pthread_cond_timedwait(&af->cond, &af->mutex, &ts))
+			break;
+	}
+	pthread_mutex_unlock(&af->mutex);
+#endif
+}
+
+/**
+ * Bump the eventfd of a driver that poll()s instead of sleeping in
+ * audio_get()
+ */
+static void fifo_signal(audio_fifo_t *af)
+{
+#ifdef __linux__
+	uint64_t one = 1;
+
+	if (write(af->efd, &one, sizeof(one)) < 0)
+		return;
+#endif
+}
+
+/**
+ * Wake the consumer if, and only if, it went to sleep on an empty ring.
+ */
+static void fifo_wakeup(audio_fifo_t *af)
+{
+	__sync_synchronize();
+
+	if (!af->waiting)
+		return;
+
+	af->waiting = 0;
+#ifdef __linux__
+	if (af->efd >= 0) {
+		fifo_signal(af);
+		return;
+	}
+
+	__sync_fetch_and_add(&af->wake, 1);
+	syscall(SYS_futex, &af->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&af->mutex);
+	af->wake++;
+	pthread_cond_signal(&af->cond);
+	pthread_mutex_unlock(&af->mutex);
+#endif
+}
+
+/**
+ * Tell the consumer about a flush, pause or shutdown. A polling driver
+ * hears of these even while it has data and isn't waiting on the fifo.
+ */
+static void fifo_notify(audio_fifo_t *af)
+{
+	if (af->efd >= 0)
+		fifo_signal(af);
+	fifo_wakeup(af);
+}
+
+/**
+ * Take the chunk at the tail of the ring. Consumer side, ring not empty.
+ */
+static audio_fifo_data_t *fifo_take(audio_fifo_t *af)
+{
+	audio_fifo_data_t *afd;
+
+	__sync_synchronize();
+	afd = af->slot[af->tail & SLOT_MASK];
+	__sync_fetch_and_sub(&af->qlen, afd->nsamples);
+	__sync_synchronize();
+	af->tail++;
+	af->consumed += afd->nsamples;
+
+	if (afd->flags & AUDIO_TRACK_START)
+		af->boundary_pending = 0;
+
+	return afd;
+}
+
+/**
+ * Abandon a running crossfade.
+ */
+static void xfade_reset(audio_fifo_t *af)
+{
+	audio_fifo_data_t *afd;
+
+	while ((afd = TAILQ_FIRST(&af->xf_tail))) {
+		TAILQ_REMOVE(&af->xf_tail, afd, link);
+		audio_fifo_free(af, afd);
+	}
+
+	if (af->xf_held)
+		audio_fifo_free(af, af->xf_held);
+
+	af->xf_held = NULL;
+	af->xf_pos = 0;
+}
+
+/**
+ * Drop everything queued before the last audio_fifo_flush(). Consumer side.
+ */
+static void fifo_discard(audio_fifo_t *af)
+{
+	if (af->generation != af->gen_seen) {
+		af->gen_seen = af->generation;
+		af->priming = af->jitter;
+		af->dry = 1;
+		af->boundary_pending = 0;
+		xfade_reset(af);
+
+		/* Drop what the device holds and fade the new audio in */
+		if (af->on_flush)
+			af->on_flush();
+		af->gain = 0;
+	}
+
+	while ((int)(af->flush - af->tail) > 0)
+		audio_fifo_free(af, fifo_take(af));
+}
+
+/**
+ * Preallocate enough chunks of one size class to fill the buffer depth,
+ * with some slack for the chunks held by the driver.
+ */
+static void pool_init(audio_pool_t *p, int frames, int depth_ms)
+{
+	int count = (int)((long)AUDIO_POOL_RATE * depth_ms / 1000) / frames + 4;
+	size_t stride;
+	int n;
+	int i;
+
+	for (n = 1; n < count; n <<= 1)
+		;
+
+	p->size = frames * AUDIO_POOL_CHANNELS * sizeof(int16_t);
+	stride = (sizeof(audio_fifo_data_t) + p->size + 15) & ~15;
+	p->mem = malloc(stride * count);
+	p->free = malloc(n * sizeof(audio_fifo_data_t *));
+	p->mask = n - 1;
+	p->head = 0;
+	p->tail = 0;
+
+	for (i = 0; i < count; ++i)
+		p->free[p->head++] = (audio_fifo_data_t *)(p->mem + stride * i);
+}
+
+/**
+ * Take a chunk from the free ring of \p p. Safe on either side: the driver
+ * takes chunks too, so the tail is claimed with a compare and swap.
+ *
+ * @return The chunk, or NULL if the ring is empty
+ */
+static audio_fifo_data_t *pool_take(audio_pool_t *p)
+{
+	audio_fifo_data_t *afd;
+	unsigned int t;
+
+	do {
+		t = p->tail;
+		if (p->head == t)
+			return NULL;
+
+		__sync_synchronize();
+		afd = p->free[t & p->mask];
+	} while (!__sync_bool_compare_and_swap(&p->tail, t, t + 1));
+
+	return afd;
+}
+
+/**
+ * Take a chunk able to hold \p s bytes of samples. Producer side.
+ *
+ * @return The chunk, or NULL if it had to come from the heap and there was
+ *         no memory
+ */
+static audio_fifo_data_t *chunk_alloc(audio_fifo_t *af, size_t s)
+{
+	audio_fifo_data_t *afd;
+	int i, n;
+
+	for (i = 0; i < AUDIO_POOL_CLASSES; ++i) {
+		if (s > af->pool[i].size || !(afd = pool_take(&af->pool[i])))
+			continue;
+
+		afd->pool = i;
+		return afd;
+	}
+
+	n = __sync_add_and_fetch(&af->heap_allocs, 1);
+	if (!(n & (n - 1)))
+		fprintf(stderr, "audio: chunk pool exhausted, %d heap allocations\n", n);
+
+	afd = malloc(sizeof(audio_fifo_data_t) + s);
+	if (afd)
+		afd->pool = -1;
+	return afd;
+}
+
+/**
+ * Take a pool chunk for up to \p frames frames of \p channels channel audio,
+ * for drivers that keep audio of their own. Never touches the heap, so it
+ * is safe on the driver thread.
+ *
+ * @return The chunk with nsamples set to the frames it has room for, or
+ *         NULL if the pool is empty
+ */
+audio_fifo_data_t *audio_fifo_alloc(audio_fifo_t *af, int frames, int channels)
+{
+	const size_t frame = channels * sizeof(int16_t);
+	audio_fifo_data_t *afd;
+	int i;
+
+	/* Smallest class that holds it all, else the largest there is */
+	for (i = 0; i < AUDIO_POOL_CLASSES - 1; ++i)
+		if (frames * frame <= af->pool[i].size)
+			break;
+
+	for (; i >= 0; --i) {
+		if (af->pool[i].size < frame || !(afd = pool_take(&af->pool[i])))
+			continue;
+
+		afd->pool = i;
+		afd->channels = channels;
+		afd->rate = 0;
+		afd->nsamples = af->pool[i].size / frame;
+		if (afd->nsamples > frames)
+			afd->nsamples = frames;
+		afd->flags = 0;
+		afd->start_ms = 0;
+		return afd;
+	}
+
+	return NULL;
+}
+
+void audio_fifo_free(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	audio_pool_t *p;
+
+	if (afd->pool < 0) {
+		free(afd);
+		return;
+	}
+
+	p = &af->pool[afd->pool];
+	p->free[p->head & p->mask] = afd;
+	__sync_synchronize();
+	p->head++;
+}
+
+/**
+ * Track how late deliveries arrive and how often the consumer runs dry, and
+ * move the target depth between the watermarks accordingly. Producer side.
+ */
+static void jitter_update(audio_fifo_t *af, int num_frames, int rate)
+{
+	int64_t now = audio_now_us();
+	int64_t late, interval = now - af->last_put_us;
+	int underruns = af->underruns;
+	int target;
+
+	/* A refused delivery means we throttled libspotify ourselves */
+	if (af->last_put_us && !af->refused) {
+		late = interval - af->expect_us;
+		if (late < 0)
+			late = 0;
+		af->jitter_us += (int)(late - af->jitter_us) / 16;
+	}
+
+	if (underruns != af->seen_underruns) {
+		af->seen_underruns = underruns;
+		af->boost_us += (af->max_ms - af->min_ms) * 250;
+	} else if (af->last_put_us) {
+		/* Give the boost back with a ten second time constant */
+		af->boost_us -= (int)((int64_t)af->boost_us * interval / 10000000);
+	}
+
+	target = af->min_ms + (4 * af->jitter_us + af->boost_us) / 1000;
+	if (target > af->max_ms)
+		target = af->max_ms;
+	if (target < af->min_ms)
+		target = af->min_ms;
+
+	af->target_ms = target;
+	af->last_put_us = now;
+	af->expect_us = (int64_t)num_frames * 1000000 / rate;
+	af->refused = 0;
+}
+
+void audio_fifo_init(audio_fifo_t *af)
+{
+	int i;
+
+	af->head = 0;
+	af->tail = 0;
+	af->flush = 0;
+	af->qlen = 0;
+	af->waiting = 0;
+	af->wake = 0;
+	af->heap_allocs = 0;
+
+	af->underruns = 0;
+	af->priming = af->jitter;
+	af->stutter = 0;
+	af->dry = 1;
+	af->paused = 0;
+	af->pause_seen = 0;
+	af->new_track = 0;
+	af->new_seek = 0;
+	af->dry_us = 0;
+	af->gap_frames = 0;
+	af->transitions = 0;
+	af->transitions_seen = 0;
+	af->generation = 0;
+	af->gen_seen = 0;
+	af->written = 0;
+	af->consumed = 0;
+	af->boundary_pending = 0;
+	TAILQ_INIT(&af->xf_tail);
+	af->xf_held = NULL;
+	af->xfades = 0;
+	af->xfades_seen = 0;
+	af->volume = DSP_UNITY;
+	af->gain = DSP_UNITY;
+	af->efd = -1;
+	af->poll_timed_out = 0;
+	af->shutdown = 0;
+	af->xrun_ms = 0;
+	memset(&af->clock, 0, sizeof(af->clock));
+	af->clock_high = 0;
+
+	dsp_init();
+
+	if (af->jitter) {
+		if (af->min_ms <= 0)
+			af->min_ms = AUDIO_JITTER_MIN_MS;
+		if (af->max_ms < af->min_ms)
+			af->max_ms = af->min_ms > AUDIO_JITTER_MAX_MS ? af->min_ms : AUDIO_JITTER_MAX_MS;
+		af->target_ms = af->min_ms;
+		af->reported_ms = af->min_ms;
+		af->depth_ms = af->max_ms;
+	}
+
+	if (af->depth_ms <= 0)
+		af->depth_ms = AUDIO_FIFO_DEPTH_MS;
+
+	if (af->xfade_ms > AUDIO_XFADE_MAX_MS)
+		af->xfade_ms = AUDIO_XFADE_MAX_MS;
+	if (af->xfade_ms > 0 && af->depth_ms < af->xfade_ms + 1000)
+		af->depth_ms = af->xfade_ms + 1000;
+
+	/*
+	 * A crossfade holds its tail outside the ring while the ring refills,
+	 * and after xruns the producer fills past the depth by xrun_ms
+	 */
+	for (i = 0; i < AUDIO_POOL_CLASSES; ++i)
+		pool_init(&af->pool[i], pool_frames[i],
+		          af->depth_ms + af->xfade_ms + AUDIO_XRUN_MAX_MS);
+
+	pthread_mutex_init(&af->mutex, NULL);
+	pthread_cond_init(&af->cond, NULL);
+}
+
+int audio_fifo_put(audio_fifo_t *af, const void *frames, int num_frames,
+                   int channels, int rate)
+{
+	audio_fifo_data_t *afd;
+	int xrun_ms = af->xrun_ms;
+	int depth_ms;
+	size_t s;
+
+	/* Past what the pool holds, every chunk would come from the heap */
+	if (xrun_ms > AUDIO_XRUN_MAX_MS)
+		xrun_ms = AUDIO_XRUN_MAX_MS;
+	depth_ms = (af->jitter ? af->target_ms : af->depth_ms) + xrun_ms;
+
+	/* Hold on to enough of the outgoing track to crossfade it */
+	if (af->xfade_ms && depth_ms < af->xfade_ms + 1000)
+		depth_ms = af->xfade_ms + 1000;
+
+	/* Full, libspotify will hand us the frames again */
+	if (af->qlen > (int)((long)rate * depth_ms / 1000) ||
+	    af->head - af->tail >= AUDIO_FIFO_SLOTS) {
+		af->refused = 1;
+		return 0;
+	}
+
+	if (af->jitter)
+		jitter_update(af, num_frames, rate);
+
+	s = num_frames * sizeof(int16_t) * channels;
+
+	afd = chunk_alloc(af, s);
+	if (!afd)
+		return 0;
+	memcpy(afd->samples, frames, s);
+
+	afd->nsamples = num_frames;
+	afd->flags = __sync_lock_test_and_set(&af->new_track, 0) ? AUDIO_TRACK_START : 0;
+	afd->start_ms = 0;
+
+	if (__sync_lock_test_and_set(&af->new_seek, 0)) {
+		afd->flags |= AUDIO_TRACK_SEEK;
+		afd->start_ms = af->seek_ms;
+	}
+
+	afd->rate = rate;
+	afd->channels = channels;
+
+	if ((afd->flags & AUDIO_TRACK_START) && !af->boundary_pending) {
+		af->boundary = af->written;
+		__sync_synchronize();
+		af->boundary_pending = 1;
+	}
+	af->written += num_frames;
+
+	af->slot[af->head & SLOT_MASK] = afd;
+	__sync_fetch_and_add(&af->qlen, num_frames);
+	__sync_synchronize();
+	af->head++;
+
+	fifo_wakeup(af);
+
+	return num_frames;
+}
+
+/**
+ * Milliseconds since the last audio_fifo_flush() or audio_fifo_pause(),
+ * for drivers to report how long a transport command took to be heard.
+ */
+unsigned int audio_fifo_since_press(audio_fifo_t *af)
+{
+	return (unsigned int)(audio_now_us() / 1000) - af->press_ms;
+}
+
+void audio_fifo_flush(audio_fifo_t *af)
+{
+	af->press_ms = (unsigned int)(audio_now_us() / 1000);
+	af->flush = af->head;
+	__sync_synchronize();
+	af->generation++;
+	fifo_notify(af);
+}
+
+/**
+ * The next chunk delivered starts a new track. Call before loading it.
+ */
+void audio_fifo_mark_track(audio_fifo_t *af)
+{
+	af->new_track = 1;
+}
+
+/**
+ * Drop what is queued and count the position from \p ms with the next
+ * chunk delivered. Call before asking libspotify to seek there.
+ */
+void audio_fifo_seek(audio_fifo_t *af, int ms)
+{
+	af->seek_ms = ms;
+	__sync_synchronize();
+	af->new_seek = 1;
+	audio_fifo_flush(af);
+}
+
+/**
+ * Set the output volume, in percent, and a ReplayGain style adjustment on
+ * top of it. Takes effect on the next chunk the driver takes.
+ */
+void audio_fifo_set_gain(audio_fifo_t *af, int percent, double replaygain_db)
+{
+	int64_t g = (int64_t)dsp_db_to_gain(replaygain_db) * percent / 100;
+
+	/* Above this the SIMD kernels would see a negative gain */
+	af->volume = g > DSP_GAIN_MAX ? DSP_GAIN_MAX : (int)g;
+}
+
+void audio_fifo_pause(audio_fifo_t *af, int pause)
+{
+	af->press_ms = (unsigned int)(audio_now_us() / 1000);
+	af->paused = !!pause;
+	fifo_notify(af);
+}
+
+/**
+ * Log what changed since the last call. The producer and the consumer only
+ * keep the numbers, so that neither does log I/O on its way.
+ */
+static void fifo_report(audio_fifo_t *af)
+{
+	unsigned int n = af->transitions - af->transitions_seen;
+	int target = af->target_ms;
+
+	if (n) {
+		__sync_synchronize();
+		if (n > 1)
+			fprintf(stderr, "audio: %u track transitions, gap %d samples at the last\n",
+			        n, af->gap_frames);
+		else
+			fprintf(stderr, "audio: track transition, gap %d samples\n", af->gap_frames);
+		af->transitions_seen += n;
+	}
+
+	if (af->xfades != af->xfades_seen) {
+		__sync_synchronize();
+		fprintf(stderr, "audio: crossfaded %d ms, mixing took %d us per chunk (%s)\n",
+		        af->xf_last_ms, af->xf_last_us, dsp_name);
+		af->xfades_seen = af->xfades;
+	}
+
+	if (af->jitter && abs(target - af->reported_ms) >= 100) {
+		fprintf(stderr, "audio: jitter buffer target %d ms (jitter %d us, %d underruns)\n",
+		        target, af->jitter_us, af->underruns);
+		af->reported_ms = target;
+	}
+}
+
+void audio_fifo_stats(audio_fifo_t *af, int *samples, int *stutter)
+{
+	*samples = af->qlen;
+	*stutter = __sync_lock_test_and_set(&af->stutter, 0);
+	fifo_report(af);
+}
+
+/**
+ * Non-zero while the consumer should hold off: the pre-roll is not queued
+ * yet and the producer is still delivering.
+ */
+static int fifo_priming(audio_fifo_t *af, int timed_out)
+{
+	audio_fifo_data_t *afd;
+
+	if (!af->priming)
+		return 0;
+
+	__sync_synchronize();
+	afd = af->slot[af->tail & SLOT_MASK];
+
+	/* A quiet producer means the stream ended short of the pre-roll */
+	if (af->qlen < (int)((long)afd->rate * af->min_ms / 1000) && !timed_out)
+		return 1;
+
+	af->priming = 0;
+	return 0;
+}
+
+/**
+ * Act on flushes, and call the driver's pause hook when the pause state
+ * changed. Consumer side.
+ *
+ * @return Non-zero while paused
+ */
+int audio_fifo_control(audio_fifo_t *af)
+{
+	fifo_discard(af);
+
+	if (!af->paused) {
+		if (af->pause_seen && af->on_pause)
+			af->on_pause(0);
+		af->pause_seen = 0;
+		return 0;
+	}
+
+	if (!af->pause_seen) {
+		if (af->on_pause)
+			af->on_pause(1);
+		af->pause_seen = 1;
+	}
+
+	return 1;
+}
+
+/**
+ * The consumer found the ring empty while playing: count an underrun and,
+ * in jitter mode, rebuffer up to the pre-roll.
+ */
+static void fifo_dry(audio_fifo_t *af)
+{
+	if (af->dry || af->priming)
+		return;
+
+	af->underruns++;
+	__sync_fetch_and_add(&af->stutter, 1);
+	af->dry = 1;
+	af->dry_us = audio_now_us();
+	af->priming = af->jitter;
+}
+
+/**
+ * Take the next chunk. With \p block unset, return NULL instead of
+ * sleeping, and don't count an empty ring as an underrun.
+ */
+static audio_fifo_data_t* fifo_get(audio_fifo_t *af, int block)
+{
+	audio_fifo_data_t *afd;
+	int timed_out = af->poll_timed_out;
+	int seq;
+
+	af->poll_timed_out = 0;
+
+	for (;;) {
+		if (!audio_fifo_control(af) &&
+		    af->head != af->tail && !fifo_priming(af, timed_out))
+			break;
+
+		if (!block)
+			return NULL;
+
+		seq = af->wake;
+		af->waiting = 1;
+		__sync_synchronize();
+
+		if ((int)(af->flush - af->tail) > 0 || af->paused != af->pause_seen) {
+			af->waiting = 0;
+			continue;
+		}
+
+		if (af->pause_seen) {
+			fifo_sleep(af, seq, 0);
+			continue;
+		}
+
+		if (af->head != af->tail) {
+			/* Back from a control change with data queued: take it */
+			if (!af->priming) {
+				af->waiting = 0;
+				continue;
+			}
+
+			/* Data, but still priming: wait for more or for a quiet producer */
+			fifo_sleep(af, seq, af->min_ms);
+			timed_out = af->wake == seq;
+			continue;
+		}
+
+		fifo_dry(af);
+		fifo_sleep(af, seq, 0);
+		timed_out = 0;
+	}
+
+	afd = fifo_take(af);
+	af->dry = 0;
+
+	if (afd->flags & AUDIO_TRACK_START) {
+		/* Conservative: the device still had audio when the fifo ran dry */
+		af->gap_frames = af->dry_us ?
+			(int)((audio_now_us() - af->dry_us) * afd->rate / 1000000) : 0;
+		__sync_synchronize();
+		af->transitions++;
+	}
+	af->dry_us = 0;
+
+	return afd;
+}
+
+/**
+ * Non-zero if \p afd, just taken, is close enough to the next track start
+ * for the crossfade to begin.
+ */
+static int xfade_due(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int left;
+
+	if (!af->xfade_ms || !af->boundary_pending || (afd->flags & AUDIO_TRACK_START))
+		return 0;
+
+	__sync_synchronize();
+	left = (int)(af->boundary - (af->consumed - afd->nsamples));
+
+	return left > 0 && left <= (int)((int64_t)afd->rate * af->xfade_ms / 1000);
+}
+
+/**
+ * Mix the outgoing tail under the start of incoming chunk \p afd, in place.
+ */
+static void xfade_mix(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	audio_fifo_data_t *t;
+	int64_t start = audio_now_us();
+	int ch = afd->channels;
+	int i = 0, n, gin;
+
+	while (i < afd->nsamples && (t = TAILQ_FIRST(&af->xf_tail))) {
+		n = t->nsamples - af->xf_pos;
+		if (n > afd->nsamples - i)
+			n = afd->nsamples - i;
+		if (n > XF_BLOCK)
+			n = XF_BLOCK;
+
+		gin = (int)((int64_t)DSP_UNITY * (af->xf_done + n / 2) / af->xf_len);
+		dsp_mix(afd->samples + i * ch, t->samples + af->xf_pos * ch,
+		        afd->samples + i * ch, n * ch, DSP_UNITY - gin, gin);
+
+		i += n;
+		af->xf_pos += n;
+		af->xf_done += n;
+
+		if (af->xf_pos == t->nsamples) {
+			TAILQ_REMOVE(&af->xf_tail, t, link);
+			audio_fifo_free(af, t);
+			af->xf_pos = 0;
+		}
+	}
+
+	af->xf_us += audio_now_us() - start;
+	af->xf_chunks++;
+
+	/* Done, leave the numbers for audio_fifo_stats() to log */
+	if (TAILQ_EMPTY(&af->xf_tail)) {
+		af->xf_last_ms = (int)((int64_t)af->xf_done * 1000 / afd->rate);
+		af->xf_last_us = (int)(af->xf_us / af->xf_chunks);
+		__sync_synchronize();
+		af->xfades++;
+	}
+}
+
+/**
+ * The crossfade stage between the ring and the driver. Once the next track
+ * start is within xfade_ms, the rest of the outgoing track is moved to
+ * xf_tail and mixed under the incoming chunks as they are taken.
+ */
+static audio_fifo_data_t* xfade_get(audio_fifo_t *af, int block)
+{
+	audio_fifo_data_t *afd, *t;
+
+	/* Formats differ: play out the tail unmixed, then the held chunk */
+	if (af->xf_held) {
+		if ((t = TAILQ_FIRST(&af->xf_tail))) {
+			TAILQ_REMOVE(&af->xf_tail, t, link);
+			return t;
+		}
+
+		afd = af->xf_held;
+		af->xf_held = NULL;
+		return afd;
+	}
+
+	afd = fifo_get(af, block);
+	if (!afd)
+		return NULL;
+
+	if (TAILQ_EMPTY(&af->xf_tail)) {
+		if (!xfade_due(af, afd))
+			return afd;
+
+		/* Gather the rest of the outgoing track, it is all queued already */
+		af->xf_len = afd->nsamples;
+		TAILQ_INSERT_TAIL(&af->xf_tail, afd, link);
+
+		while (af->head != af->tail &&
+		       !(af->slot[af->tail & SLOT_MASK]->flags & AUDIO_TRACK_START)) {
+			t = fifo_take(af);
+			af->xf_len += t->nsamples;
+			TAILQ_INSERT_TAIL(&af->xf_tail, t, link);
+		}
+
+		af->xf_pos = 0;
+		af->xf_done = 0;
+		af->xf_us = 0;
+		af->xf_chunks = 0;
+
+		afd = fifo_get(af, block);
+		if (!afd)
+			return NULL;
+	}
+
+	/* A flush may have abandoned the fade meanwhile */
+	t = TAILQ_FIRST(&af->xf_tail);
+	if (!t)
+		return afd;
+
+	if (t->rate != afd->rate || t->channels != afd->channels) {
+		af->xf_held = afd;
+		return xfade_get(af, block);
+	}
+
+	xfade_mix(af, afd);
+	return afd;
+}
+
+/**
+ * Apply the volume to a chunk on its way to the driver, ramping from the
+ * previous gain so changes don't click.
+ */
+static audio_fifo_data_t* gain_apply(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int target = af->volume;
+	int ch, n = 0;
+
+	if (!afd)
+		return NULL;
+
+	ch = afd->channels;
+
+	if (af->gain != target) {
+		n = afd->rate / GAIN_RAMP;
+		if (n > afd->nsamples)
+			n = afd->nsamples;
+
+		dsp_ramp(afd->samples, n, ch, af->gain, target);
+		af->gain = target;
+	}
+
+	if (target != DSP_UNITY)
+		dsp_gain(afd->samples + n * ch, (afd->nsamples - n) * ch, target);
+
+	return afd;
+}
 
 audio_fifo_data_t* audio_get(audio_fifo_t *af)
 {
-    audio_fifo_data_t *afd;
-    pthread_mutex_lock(&af->mutex);
-  
-    while (!(afd = TAILQ_FIRST(&af->q)))
-	pthread_cond_wait(&af->cond, &af->mutex);
-  
-    TAILQ_REMOVE(&af->q, afd, link);
-    af->qlen -= afd->nsamples;
-  
-    pthread_mutex_unlock(&af->mutex);
-    return afd;
+	return gain_apply(af, xfade_get(af, 1));
+}
+
+audio_fifo_data_t* audio_tryget(audio_fifo_t *af)
+{
+	return gain_apply(af, xfade_get(af, 0));
+}
+
+/**
+ * Have the fifo signal an eventfd, for a driver that poll()s it alongside
+ * the device instead of sleeping in audio_get(). Flushes, pauses and
+ * shutdown always signal it; new data only after audio_fifo_arm().
+ *
+ * @return The eventfd, or -1 where there is none
+ */
+int audio_fifo_eventfd(audio_fifo_t *af)
+{
+#ifdef __linux__
+	af->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	return af->efd;
+}
+
+/**
+ * Announce that the consumer is about to poll() the eventfd for data.
+ *
+ * @return poll() timeout: 0 if there is something to act on already, the
+ *         time the pre-roll may still wait for the producer, or -1
+ */
+int audio_fifo_arm(audio_fifo_t *af)
+{
+	af->waiting = 1;
+	__sync_synchronize();
+
+	if ((int)(af->flush - af->tail) > 0 || af->paused != af->pause_seen || af->shutdown) {
+		af->waiting = 0;
+		return 0;
+	}
+
+	if (af->pause_seen)
+		return -1;
+
+	if (af->head != af->tail) {
+		if (af->priming)
+			return af->min_ms;
+
+		af->waiting = 0;
+		return 0;
+	}
+
+	fifo_dry(af);
+	return -1;
+}
+
+/**
+ * The consumer is back from poll(). \p timed_out says it slept the whole
+ * timeout audio_fifo_arm() gave it, which ends a pre-roll early.
+ */
+void audio_fifo_disarm(audio_fifo_t *af, int timed_out)
+{
+#ifdef __linux__
+	uint64_t n;
+
+	if (read(af->efd, &n, sizeof(n)) < 0)
+		n = 0;
+#endif
+	af->waiting = 0;
+	af->poll_timed_out = timed_out;
+}
+
+/**
+ * Ask a polling driver to stop and close the device, and give it a moment
+ * to do so.
+ */
+void audio_fifo_shutdown(audio_fifo_t *af)
+{
+	int i;
+
+	af->shutdown = 1;
+	fifo_notify(af);
+
+	for (i = 0; af->efd >= 0 && af->shutdown != 2 && i < 500; ++i)
+		usleep(1000);
+}
+
+/* -----------------------------  PLAYBACK CLOCK  ----------------------------- */
+static void clock_begin(audio_clock_t *c)
+{
+	c->seq++;
+	__sync_synchronize();
+}
+
+static void clock_end(audio_clock_t *c)
+{
+	__sync_synchronize();
+	c->seq++;
+}
+
+/**
+ * Restart the position at chunk \p afd, which begins \p offset frames past
+ * what has been reported through audio_clock_wrote(). Does nothing unless
+ * the chunk starts a track or follows a seek. Driver side.
+ */
+void audio_clock_anchor(audio_fifo_t *af, const audio_fifo_data_t *afd, int offset)
+{
+	audio_clock_t *c = &af->clock;
+
+	if (!(afd->flags & (AUDIO_TRACK_START | AUDIO_TRACK_SEEK)))
+		return;
+
+	clock_begin(c);
+	c->prev_track = c->track;
+	c->prev_anchor = c->anchor;
+	c->prev_ms = c->anchor_ms;
+	c->anchor = c->written + offset;
+	c->anchor_ms = (afd->flags & AUDIO_TRACK_SEEK) ? afd->start_ms : 0;
+	if (afd->flags & AUDIO_TRACK_START)
+		c->track++;
+	c->epoch++;
+	clock_end(c);
+}
+
+/**
+ * Count \p frames handed to the device, or taken back from it if negative.
+ * Driver side.
+ */
+void audio_clock_wrote(audio_fifo_t *af, int frames)
+{
+	audio_clock_t *c = &af->clock;
+
+	clock_begin(c);
+	c->written += frames;
+	clock_end(c);
+}
+
+/**
+ * Report that the device had \p delay frames left to play just now, and
+ * whether it is playing them. Driver side.
+ */
+void audio_clock_sync(audio_fifo_t *af, int delay, int running)
+{
+	audio_clock_t *c = &af->clock;
+
+	clock_begin(c);
+	c->delay = delay;
+	c->when_us = audio_now_us();
+	c->running = running;
+	clock_end(c);
+}
+
+/**
+ * The device now runs at \p rate. Call with the device drained, so the
+ * anchors can be moved to what has been written at the old rate.
+ */
+void audio_clock_rate(audio_fifo_t *af, int rate)
+{
+	audio_clock_t *c = &af->clock;
+
+	if (c->rate == rate)
+		return;
+
+	clock_begin(c);
+	if (c->rate) {
+		c->anchor_ms += (int)((c->written - c->anchor) * 1000 / c->rate);
+		c->prev_ms += (int)((c->written - c->prev_anchor) * 1000 / c->rate);
+		c->anchor = c->prev_anchor = c->written;
+	}
+	c->rate = rate;
+	c->delay = 0;
+	clock_end(c);
 }
 
+/**
+ * Position in ms of what is audible right now, in the track \p track is
+ * set to (a count of track starts). Frames written less the device delay,
+ * moved forward by the time since the driver last reported.
+ *
+ * Lock-free and safe from any thread. The position only moves backwards
+ * at a seek.
+ */
+int audio_fifo_position(audio_fifo_t *af, unsigned int *track)
+{
+	audio_clock_t *c = &af->clock;
+	audio_clock_t s;
+	unsigned int seq, epoch, t;
+	int64_t played, ahead, key, high;
+	int ms;
+
+	do {
+		seq = c->seq;
+		__sync_synchronize();
+		s = *c;
+		__sync_synchronize();
+	} while ((seq & 1) || seq != c->seq);
+
+	if (!s.rate) {
+		if (track)
+			*track = s.track;
+		return 0;
+	}
+
+	played = s.written - s.delay;
+	if (s.running) {
+		ahead = (audio_now_us() - s.when_us) * s.rate / 1000000;
+		played += ahead < s.delay ? ahead : s.delay;
+	}
+
+	/* The audio before the anchor is still playing out */
+	if (played >= s.anchor || !s.epoch) {
+		ms = s.anchor_ms + (int)((played - s.anchor) * 1000 / s.rate);
+		epoch = s.epoch;
+		t = s.track;
+	} else {
+		ms = s.prev_ms + (int)((played - s.prev_anchor) * 1000 / s.rate);
+		epoch = s.epoch - 1;
+		t = s.prev_track;
+	}
+
+	if (ms < 0)
+		ms = 0;
+
+	/* A reader that saw an older snapshot may have got further already */
+	key = (int64_t)epoch << 32 | (unsigned int)ms;
+	do {
+		high = af->clock_high;
+		if (high >= key) {
+			if ((unsigned int)(high >> 32) == epoch)
+				ms = (int)(high & 0xffffffff);
+			break;
+		}
+	} while (!__sync_bool_compare_and_swap(&af->clock_high, high, key));
+
+	if (track)
+		*track = t;
+	return ms;
+}
@@ -38,20 +38,205 @@ typedef struct audio_fifo_data {
 	int channels;
 	int rate;
 	int nsamples;
+	int pool;	///< Size class this chunk came from, -1 for the heap
+	int flags;	///< AUDIO_* chunk flags
+	int start_ms;	///< Track position of the first frame, with AUDIO_TRACK_SEEK
 	int16_t samples[0];
 } audio_fifo_data_t;
 
+/// First chunk of a new track
+#define AUDIO_TRACK_START 1
+/// First chunk after audio_fifo_seek()
+#define AUDIO_TRACK_SEEK 2
+
+/// Number of chunk slots in the fifo ring. Must be a power of two.
+#define AUDIO_FIFO_SLOTS 256
+/// Default amount of audio buffered ahead of the driver
+#define AUDIO_FIFO_DEPTH_MS 1000
+/// Default jitter buffer watermarks
+#define AUDIO_JITTER_MIN_MS 200
+#define AUDIO_JITTER_MAX_MS 2000
+/// Longest supported crossfade
+#define AUDIO_XFADE_MAX_MS 12000
+/// Most extra depth a grown device buffer gets, the pool has room for it
+#define AUDIO_XRUN_MAX_MS 1000
+/// Number of chunk size classes in the pool
+#define AUDIO_POOL_CLASSES 2
+/// Highest rate and most channels the pool is sized for. Other streams still
+/// play, from heap chunks counted in heap_allocs.
+#define AUDIO_POOL_RATE 48000
+#define AUDIO_POOL_CHANNELS 2
+
+/**
+ * Preallocated chunks of one size class.
+ *
+ * The producer takes chunks from the free ring and the consumer returns
+ * them, so like the fifo itself it needs no lock. The consumer may take
+ * chunks too, with audio_fifo_alloc().
+ */
+typedef struct audio_pool {
+	audio_fifo_data_t **free;	///< Ring of free chunks
+	unsigned int mask;		///< Ring size minus one
+	volatile unsigned int head;	///< Next slot to return to, written by the consumer
+	volatile unsigned int tail;	///< Next slot to take from, see pool_take()
+	size_t size;			///< Sample bytes per chunk
+	char *mem;
+} audio_pool_t;
+
+/**
+ * Playback clock, see audio_fifo_position().
+ *
+ * Only the driver thread writes it. Readers on any thread retry until they
+ * see the same even sequence number before and after their copy.
+ */
+typedef struct audio_clock {
+	volatile unsigned int seq;	///< Odd while the driver updates the clock
+	int rate;			///< Device frames per second
+	int running;			///< Device is playing, the position advances between updates
+	int64_t written;		///< Device frames ever written and not taken back
+	int64_t delay;			///< Of those, frames not yet played at when_us
+	int64_t when_us;		///< When delay was sampled
+	unsigned int epoch;		///< Bumped by every anchor, the position restarts there
+	unsigned int track;		///< Bumped by every track start
+	int64_t anchor;			///< Value of written where the current position was anchored
+	int anchor_ms;			///< Track position at anchor
+	unsigned int prev_track;	///< Track of the anchor before, audible until anchor is
+	int64_t prev_anchor;
+	int prev_ms;
+} audio_clock_t;
+
+/**
+ * Single-producer/single-consumer queue of PCM chunks.
+ *
+ * music_delivery() is the only producer and the driver thread the only
+ * consumer, so neither side takes a lock. The consumer only sleeps (and
+ * the producer only issues a wakeup) when the ring runs empty.
+ */
 typedef struct audio_fifo {
-	TAILQ_HEAD(, audio_fifo_data) q;
-	int qlen;
-	pthread_mutex_t mutex;
+	audio_fifo_data_t *slot[AUDIO_FIFO_SLOTS];
+	volatile unsigned int head;	///< Next slot to fill, written by the producer
+	volatile unsigned int tail;	///< Next slot to drain, written by the consumer
+	volatile unsigned int flush;	///< Slots before this index are discarded
+	volatile int qlen;		///< Frames currently queued
+	volatile int waiting;		///< Non-zero while the consumer sleeps
+	volatile int wake;		///< Wakeup sequence number (futex word)
+	pthread_mutex_t mutex;		///< Sleep path only, where there is no futex
 	pthread_cond_t cond;
+
+	int depth_ms;			///< Buffer depth, set before audio_init() (0 = default)
+	audio_pool_t pool[AUDIO_POOL_CLASSES];
+	volatile int heap_allocs;	///< Chunks that did not fit in the pool
+
+	/* Adaptive jitter buffer, enabled by setting jitter before audio_init() */
+	int jitter;			///< Non-zero to adapt the depth between min_ms and max_ms
+	int min_ms;			///< Low watermark, also the pre-roll threshold
+	int max_ms;			///< High watermark
+	volatile int target_ms;		///< Depth the producer currently fills up to
+	int reported_ms;		///< Target last logged by audio_fifo_stats()
+	int jitter_us;			///< Smoothed lateness of deliveries
+	int boost_us;			///< Extra depth added after underruns, decays over time
+	int seen_underruns;		///< Underrun count last acted upon by the producer
+	int refused;			///< A delivery was refused since the last accepted one
+	int64_t last_put_us;		///< Arrival time of the last accepted delivery
+	int64_t expect_us;		///< Play time of the last accepted delivery
+	volatile int underruns;		///< Times the consumer ran the ring dry
+	int priming;			///< Consumer holds off until the pre-roll is queued
+
+	volatile int stutter;		///< Underruns since the last audio_fifo_stats()
+	int dry;			///< Ring ran dry and has not been refilled yet
+	volatile int paused;		///< Consumer must not play anything
+	int pause_seen;			///< Consumer has acted on paused
+	void (*on_pause)(int pause);	///< Driver hook, called on the consumer thread
+	void (*on_flush)(void);		///< Driver hook, drop what the device still holds
+	volatile unsigned int press_ms;	///< When the last flush or pause was asked for
+
+	volatile int new_track;		///< Flag the next delivered chunk as a track start
+	volatile int new_seek;		///< Flag the next delivered chunk as a seek target
+	volatile int seek_ms;		///< Where audio_fifo_seek() went
+	int64_t dry_us;			///< When the consumer last ran dry, 0 if it has not since
+	int gap_frames;			///< Silence before the last track start, in frames
+	volatile unsigned int transitions;	///< Track starts taken, written by the consumer
+	unsigned int transitions_seen;	///< Of those, ones audio_fifo_stats() has logged
+	volatile unsigned int generation;	///< Bumped by every audio_fifo_flush()
+	unsigned int gen_seen;		///< Generation the consumer last acted upon
+
+	/* Crossfade, enabled by setting xfade_ms before audio_init() */
+	int xfade_ms;			///< Overlap between consecutive tracks, 0 to disable
+	volatile unsigned int written;	///< Frames ever queued, producer side
+	unsigned int consumed;		///< Frames ever taken off the ring, consumer side
+	volatile unsigned int boundary;	///< Value of written where the next track starts
+	volatile int boundary_pending;	///< A track start is queued but not taken yet
+	TAILQ_HEAD(, audio_fifo_data) xf_tail;	///< End of the outgoing track, fading out
+	audio_fifo_data_t *xf_held;	///< Incoming chunk held back while the tail plays out
+	int xf_pos;			///< Frames of the first tail chunk already mixed
+	int xf_len;			///< Length of the running fade in frames
+	int xf_done;			///< Frames of the running fade mixed so far
+	int64_t xf_us;			///< Time spent mixing in the running fade
+	int xf_chunks;			///< Chunks mixed in the running fade
+	int xf_last_ms;			///< Length of the last complete fade
+	int xf_last_us;			///< Mixing time per chunk in it
+	volatile unsigned int xfades;	///< Fades completed, written by the consumer
+	unsigned int xfades_seen;	///< Of those, ones audio_fifo_stats() has logged
+
+	/* Output device, set before audio_init() */
+	const char *device;		///< Device name, NULL for the calibrated one or "default"
+	int period_frames;		///< Period size override, 0 for the calibrated or default one
+	int buffer_frames;		///< Buffer size override, 0 likewise
+	int calibrate;			///< Measure period/buffer sizes first and save the best
+	int nonblock;			///< Never block in device writes, see snd_pcm_nonblock()
+	int rw;				///< Write with snd_pcm_writei() even where the device offers mmap
+	int tsched;			///< Top a large device buffer up on a timer instead of per period
+	int sim_jitter_ms;		///< Dummy driver: random lateness added to each wakeup
+	int xrun_limit;			///< Xruns within 30 s that grow the device buffer, 0 for the default, -1 never
+	volatile int xrun_ms;		///< Extra depth the driver asks for while its buffer is grown, up to AUDIO_XRUN_MAX_MS
+
+	/* Output format, set before audio_init() */
+	int out_rate;			///< Fixed device rate to convert to, 0 to follow the stream
+	int quality;			///< RESAMPLE_* preset for the conversion
+
+	volatile int volume;		///< Requested gain in Q12, see audio_fifo_set_gain()
+	int gain;			///< Gain applied to the last chunk, ramps towards volume
+
+	audio_clock_t clock;		///< Written by the driver, read by anyone
+	volatile int64_t clock_high;	///< Latest position handed out, epoch << 32 | ms
+
+	/* Drivers that poll() instead of sleeping in audio_get() */
+	int efd;			///< See audio_fifo_eventfd(), -1 if unused
+	int poll_timed_out;		///< The last poll() ended a pre-roll wait
+	volatile int shutdown;		///< 1 asks the driver to stop, 2 once it has
 } audio_fifo_t;
 
 
+/* --- Globals --- */
+/// Device options the linked driver reads, as option letters, see options.c
+extern const char audio_driver_options[];
+
 /* --- Functions --- */
 extern void audio_init(audio_fifo_t *af);
+extern void audio_fifo_init(audio_fifo_t *af);
 extern void audio_fifo_flush(audio_fifo_t *af);
+extern audio_fifo_data_t *audio_fifo_alloc(audio_fifo_t *af, int frames, int channels);
+extern void audio_fifo_free(audio_fifo_t *af, audio_fifo_data_t *afd);
+extern void audio_fifo_pause(audio_fifo_t *af, int pause);
+extern void audio_fifo_mark_track(audio_fifo_t *af);
+extern void audio_fifo_seek(audio_fifo_t *af, int ms);
+extern int audio_fifo_position(audio_fifo_t *af, unsigned int *track);
+extern void audio_fifo_set_gain(audio_fifo_t *af, int percent, double replaygain_db);
+extern void audio_fifo_stats(audio_fifo_t *af, int *samples, int *stutter);
+extern int audio_fifo_put(audio_fifo_t *af, const void *frames, int num_frames,
+                          int channels, int rate);
 audio_fifo_data_t* audio_get(audio_fifo_t *af);
+audio_fifo_data_t* audio_tryget(audio_fifo_t *af);
+extern int64_t audio_now_us(void);
+extern unsigned int audio_fifo_since_press(audio_fifo_t *af);
+extern int audio_fifo_control(audio_fifo_t *af);
+extern int audio_fifo_eventfd(audio_fifo_t *af);
+extern int audio_fifo_arm(audio_fifo_t *af);
+extern void audio_fifo_disarm(audio_fifo_t *af, int timed_out);
+extern void audio_fifo_shutdown(audio_fifo_t *af);
+extern void audio_clock_anchor(audio_fifo_t *af, const audio_fifo_data_t *afd, int offset);
+extern void audio_clock_wrote(audio_fifo_t *af, int frames);
+extern void audio_clock_sync(audio_fifo_t *af, int delay, int running);
+extern void audio_clock_rate(audio_fifo_t *af, int rate);
 
 #endif /* _JUKEBOX_AUDIO_H_ */
@@ -0,0 +1,361 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Sample processing kernels: scalar versions plus SSE2 (i686) and NEON
+ * (OpenPandora) ones, chosen at runtime by dsp_init().
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define DSP_SSE2
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#include <emmintrin.h>
+#pragma GCC pop_options
+#endif
+
+#if defined(__ARM_NEON__)
+#define DSP_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+typedef void (*mix_fn)(int16_t *dst, const int16_t *a, const int16_t *b,
+                       int n, int ga, int gb);
+typedef void (*gain_fn)(int16_t *buf, int n, int g);
+typedef void (*fir2_fn)(int16_t *dst, const int16_t *x, const int16_t *c, int taps);
+
+const char *dsp_name = "scalar";
+mix_fn dsp_mix;
+gain_fn dsp_gain;
+fir2_fn dsp_fir2;
+
+
+static inline int16_t sat16(int32_t v)
+{
+	if (v > 32767)
+		return 32767;
+	if (v < -32768)
+		return -32768;
+	return v;
+}
+
+
+/* --------------------------------  SCALAR  ------------------------------- */
+static void mix_scalar(int16_t *dst, const int16_t *a, const int16_t *b,
+                       int n, int ga, int gb)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = sat16((a[i] * ga + b[i] * gb + DSP_UNITY / 2) >> 12);
+}
+
+static void gain_scalar(int16_t *buf, int n, int g)
+{
+	int i;
+
+	for (i = 0; i < n; ++i)
+		buf[i] = sat16((buf[i] * g + DSP_UNITY / 2) >> 12);
+}
+
+static void fir2_scalar(int16_t *dst, const int16_t *x, const int16_t *c, int taps)
+{
+	int32_t l = 0, r = 0;
+	int i;
+
+	for (i = 0; i < taps * 2; i += 2) {
+		l += x[i] * c[i];
+		r += x[i + 1] * c[i + 1];
+	}
+
+	dst[0] = sat16((l + DSP_FIR_UNITY / 2) >> 14);
+	dst[1] = sat16((r + DSP_FIR_UNITY / 2) >> 14);
+}
+
+
+/* ---------------------------------  SSE2  -------------------------------- */
+#ifdef DSP_SSE2
+#pragma GCC push_options
+#pragma GCC target("sse2")
+
+static void mix_sse2(int16_t *dst, const int16_t *a, const int16_t *b,
+                     int n, int ga, int gb)
+{
+	/* Interleave a and b so one madd computes a * ga + b * gb */
+	const __m128i g = _mm_set1_epi32((gb << 16) | (ga & 0xffff));
+	const __m128i round = _mm_set1_epi32(DSP_UNITY / 2);
+	__m128i va, vb, lo, hi;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + i));
+		lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), g);
+		hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), g);
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, round), 12);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, round), 12);
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+	}
+
+	mix_scalar(dst + i, a + i, b + i, n - i, ga, gb);
+}
+
+static void gain_sse2(int16_t *buf, int n, int g)
+{
+	/* 16x16 -> 32 bit products from the low and high halves */
+	const __m128i vg = _mm_set1_epi16(g);
+	const __m128i round = _mm_set1_epi32(DSP_UNITY / 2);
+	__m128i x, pl, ph, lo, hi;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = _mm_loadu_si128((const __m128i *)(buf + i));
+		pl = _mm_mullo_epi16(x, vg);
+		ph = _mm_mulhi_epi16(x, vg);
+		lo = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(pl, ph), round), 12);
+		hi = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(pl, ph), round), 12);
+		_mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(lo, hi));
+	}
+
+	gain_scalar(buf + i, n - i, g);
+}
+
+static void fir2_sse2(int16_t *dst, const int16_t *x, const int16_t *c, int taps)
+{
+	/* Lanes accumulate L R L R, folded together at the end */
+	__m128i acc = _mm_setzero_si128();
+	__m128i vx, vc, pl, ph;
+	int32_t out;
+	int i;
+
+	for (i = 0; i < taps * 2; i += 8) {
+		vx = _mm_loadu_si128((const __m128i *)(x + i));
+		vc = _mm_loadu_si128((const __m128i *)(c + i));
+		pl = _mm_mullo_epi16(vx, vc);
+		ph = _mm_mulhi_epi16(vx, vc);
+		acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(pl, ph));
+		acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(pl, ph));
+	}
+
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(DSP_FIR_UNITY / 2)), 14);
+	out = _mm_cvtsi128_si32(_mm_packs_epi32(acc, acc));
+	memcpy(dst, &out, sizeof(out));
+}
+
+static int have_sse2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+}
+
+#pragma GCC pop_options
+#endif
+
+
+/* ---------------------------------  NEON  -------------------------------- */
+#ifdef DSP_NEON
+static void mix_neon(int16_t *dst, const int16_t *a, const int16_t *b,
+                     int n, int ga, int gb)
+{
+	const int16x4_t vga = vdup_n_s16(ga);
+	const int16x4_t vgb = vdup_n_s16(gb);
+	int16x8_t va, vb;
+	int32x4_t lo, hi;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		va = vld1q_s16(a + i);
+		vb = vld1q_s16(b + i);
+		lo = vmlal_s16(vmull_s16(vget_low_s16(va), vga), vget_low_s16(vb), vgb);
+		hi = vmlal_s16(vmull_s16(vget_high_s16(va), vga), vget_high_s16(vb), vgb);
+		vst1q_s16(dst + i, vcombine_s16(vqrshrn_n_s32(lo, 12), vqrshrn_n_s32(hi, 12)));
+	}
+
+	mix_scalar(dst + i, a + i, b + i, n - i, ga, gb);
+}
+
+static void gain_neon(int16_t *buf, int n, int g)
+{
+	const int16x4_t vg = vdup_n_s16(g);
+	int16x8_t x;
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		x = vld1q_s16(buf + i);
+		vst1q_s16(buf + i, vcombine_s16(vqrshrn_n_s32(vmull_s16(vget_low_s16(x), vg), 12),
+		                                vqrshrn_n_s32(vmull_s16(vget_high_s16(x), vg), 12)));
+	}
+
+	gain_scalar(buf + i, n - i, g);
+}
+
+static void fir2_neon(int16_t *dst, const int16_t *x, const int16_t *c, int taps)
+{
+	int32x4_t acc = vdupq_n_s32(0);
+	int32x2_t lr;
+	int16x8_t vx, vc;
+	int16x4_t out;
+	int i;
+
+	for (i = 0; i < taps * 2; i += 8) {
+		vx = vld1q_s16(x + i);
+		vc = vld1q_s16(c + i);
+		acc = vmlal_s16(acc, vget_low_s16(vx), vget_low_s16(vc));
+		acc = vmlal_s16(acc, vget_high_s16(vx), vget_high_s16(vc));
+	}
+
+	lr = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+	out = vqrshrn_n_s32(vcombine_s32(lr, lr), 14);
+	dst[0] = vget_lane_s16(out, 0);
+	dst[1] = vget_lane_s16(out, 1);
+}
+
+static int have_neon(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+}
+#endif
+
+
+/* -------------------------------  DISPATCH  ------------------------------ */
+static int have_scalar(void)
+{
+	return 1;
+}
+
+/**
+ * Kernel sets, slowest first. dsp_init() picks the last one supported.
+ */
+static const struct dsp_impl {
+	const char *name;
+	int (*supported)(void);
+	mix_fn mix;
+	gain_fn gain;
+	fir2_fn fir2;
+} impls[] = {
+	{ "scalar", have_scalar, mix_scalar, gain_scalar, fir2_scalar },
+#ifdef DSP_SSE2
+	{ "sse2", have_sse2, mix_sse2, gain_sse2, fir2_sse2 },
+#endif
+#ifdef DSP_NEON
+	{ "neon", have_neon, mix_neon, gain_neon, fir2_neon },
+#endif
+};
+
+#define NUM_IMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+void dsp_init(void)
+{
+	int i;
+
+	for (i = 0; i < NUM_IMPLS; ++i) {
+		if (!impls[i].supported())
+			continue;
+
+		dsp_name = impls[i].name;
+		dsp_mix = impls[i].mix;
+		dsp_gain = impls[i].gain;
+		dsp_fir2 = impls[i].fir2;
+	}
+}
+
+void dsp_ramp(int16_t *buf, int frames, int channels, int g0, int g1)
+{
+	int i, c, g;
+
+	for (i = 0; i < frames; ++i) {
+		g = g0 + (g1 - g0) * i / frames;
+
+		for (c = 0; c < channels; ++c, ++buf)
+			*buf = sat16((*buf * g + DSP_UNITY / 2) >> 12);
+	}
+}
+
+int dsp_db_to_gain(double db)
+{
+	double g = DSP_UNITY * pow(10.0, db / 20.0);
+
+	return g > DSP_GAIN_MAX ? DSP_GAIN_MAX : (int)(g + 0.5);
+}
+
+
+/* ------------------------------  BENCHMARK  ------------------------------ */
+#define BENCH_FRAMES 4096
+#define BENCH_ROUNDS 2000
+#define BENCH_TAPS 32
+
+static double bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void dsp_benchmark(void)
+{
+	static int16_t a[BENCH_FRAMES * 2], b[BENCH_FRAMES * 2];
+	const double frames = (double)BENCH_FRAMES * BENCH_ROUNDS;
+	double t, mix, gain, fir;
+	int i, r, f;
+
+	for (i = 0; i < BENCH_FRAMES * 2; ++i) {
+		a[i] = (i * 7919) & 0x7fff;
+		b[i] = -a[i];
+	}
+
+	printf("dsp: ns/frame for %d stereo frames x %d rounds\n", BENCH_FRAMES, BENCH_ROUNDS);
+
+	for (i = 0; i < NUM_IMPLS; ++i) {
+		if (!impls[i].supported())
+			continue;
+
+		t = bench_ns();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			impls[i].mix(b, a, b, BENCH_FRAMES * 2, DSP_UNITY / 2, DSP_UNITY / 2);
+		mix = (bench_ns() - t) / frames;
+
+		t = bench_ns();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			impls[i].gain(a, BENCH_FRAMES * 2, DSP_UNITY - 1);
+		gain = (bench_ns() - t) / frames;
+
+		/* One output frame per input frame, as when resampling 1:1 */
+		t = bench_ns();
+		for (r = 0; r < BENCH_ROUNDS; ++r)
+			for (f = 0; f + BENCH_TAPS <= BENCH_FRAMES; ++f)
+				impls[i].fir2(b + f * 2, a + f * 2, a, BENCH_TAPS);
+		fir = (bench_ns() - t) / frames;
+
+		printf("dsp: %-8s mix %6.2f  gain %6.2f  fir%d %6.2f\n",
+		       impls[i].name, mix, gain, BENCH_TAPS, fir);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Sample processing kernels for interleaved int16 PCM.
+ *
+ * Gains are Q12 fixed point, DSP_UNITY is 1.0. Every kernel saturates.
+ */
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include <stdint.h>
+
+#define DSP_UNITY 4096
+/// Largest gain the kernels take, the SIMD ones broadcast it as int16
+#define DSP_GAIN_MAX 32767
+/// FIR coefficients are Q14
+#define DSP_FIR_UNITY 16384
+
+/* --- Functions --- */
+/// Pick the fastest kernels this CPU supports. Call once before use.
+extern void dsp_init(void);
+/// Name of the kernel set dsp_init() picked
+extern const char *dsp_name;
+
+/// dst[i] = a[i] * ga + b[i] * gb, over \p n samples. dst may alias a or b.
+extern void (*dsp_mix)(int16_t *dst, const int16_t *a, const int16_t *b,
+                       int n, int ga, int gb);
+/// buf[i] *= g, over \p n samples
+extern void (*dsp_gain)(int16_t *buf, int n, int g);
+/**
+ * One stereo output frame from \p taps interleaved frames at \p x and
+ * Q14 coefficients \p c, stored once per channel (c0 c0 c1 c1 ...).
+ * \p taps must be a multiple of four.
+ */
+extern void (*dsp_fir2)(int16_t *dst, const int16_t *x, const int16_t *c, int taps);
+/// Scale \p frames frames with a gain moving linearly from \p g0 to \p g1
+extern void dsp_ramp(int16_t *buf, int frames, int channels, int g0, int g1);
+/// Convert decibels to a Q12 gain
+extern int dsp_db_to_gain(double db);
+/// Time every kernel this CPU supports and print ns/frame for each
+extern void dsp_benchmark(void);
+
+#endif /* _DSP_H_ */
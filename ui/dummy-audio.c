@@ -20,55 +20,392 @@
  * THE SOFTWARE.
  *
  *
- * ALSA audio output driver.
+ * Dummy audio output driver: a sink that plays nothing, but takes frames
+ * at the stream's sample rate like a sound card would, for benchmarking
+ * the delivery pipeline on machines without one.
  *
  * This file is part of the libspotify examples suite.
  */
 
-#include <asoundlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include "audio.h"
 
-static void* alsa_audio_start(void *aux)
+/// Simulated period, unless -P says otherwise
+#define DUMMY_PERIOD 1024
+/// Simulated buffer in periods, unless -b says otherwise
+#define DUMMY_PERIODS 4
+/// Longest sleep where there is no eventfd to wake us early
+#define FALLBACK_POLL_MS 10
+
+static struct dummy_state {
+	int rate;		/* Format the simulated device runs at */
+	int channels;
+	int period;		/* Frames the device takes per tick */
+	int buffer;		/* Frames it holds at most */
+	int fill;		/* Frames it holds now */
+
+	audio_fifo_data_t *cur;	/* Chunk being moved into the device */
+	int pos;		/* Frames of cur already moved */
+	int want_flush;		/* Fifo was flushed, drop what the device holds */
+	audio_fifo_t *af;
+	int tfd;		/* Timer for the next tick, -1 to sleep without the fifo */
+
+	int running;		/* Device is playing, ticking from start_ns */
+	int64_t start_ns;
+	int64_t ticks;		/* Periods played since start_ns */
+
+	int64_t stats_ns;	/* Start of the current stats interval */
+	int underruns;		/* Ticks that found less than a period, in the interval */
+	int wakeups;
+	int64_t late_ns;	/* Sum and worst of timed wakeups past their tick */
+	int64_t late_max_ns;
+	int timed;		/* Timed wakeups in the interval */
+	int64_t played;		/* Frames the device took in the interval */
+	int depth_min;		/* Fifo depth seen at each wakeup, in frames */
+	int depth_max;
+	int64_t depth_sum;
+	int fill_min;		/* Device fill likewise */
+} state;
+
+static int64_t now_ns(void)
 {
-	audio_fifo_t *af = aux;
+	struct timespec ts;
 
-	while(1)
-		free(audio_get(af));
-	return NULL;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void audio_init(audio_fifo_t *af)
+static int64_t period_ns(void)
 {
-	pthread_t tid;
+	return (int64_t)state.period * 1000000000 / state.rate;
+}
 
-	TAILQ_INIT(&af->q);
-	af->qlen = 0;
+/**
+ * Size the simulated device for \p afd's format. Called with the device
+ * empty, as a real one would be after draining.
+ */
+static void dummy_format(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	state.rate = afd->rate;
+	state.channels = afd->channels;
+	state.period = af->period_frames ? af->period_frames : DUMMY_PERIOD;
+	state.buffer = af->buffer_frames ? af->buffer_frames : state.period * DUMMY_PERIODS;
+	if (state.buffer < state.period)
+		state.buffer = state.period;
 
-	pthread_mutex_init(&af->mutex, NULL);
-	pthread_cond_init(&af->cond, NULL);
+	state.running = 0;
+	audio_clock_rate(af, state.rate);
 
-	pthread_create(&tid, NULL, alsa_audio_start, af);
+	fprintf(stderr, "audio: dummy device at %d Hz, %d channels, period %d, buffer %d frames, "
+	        "wakeup jitter up to %d ms\n", state.rate, state.channels, state.period,
+	        state.buffer, af->sim_jitter_ms);
 }
 
-void audio_fifo_flush(audio_fifo_t *af)
+/**
+ * Move frames from the fifo into the simulated device until it is full,
+ * the fifo has nothing more, or the next chunk needs another format.
+ */
+static void dummy_top_up(audio_fifo_t *af)
 {
 	audio_fifo_data_t *afd;
+	int n, added = 0;
+
+	for (;;) {
+		if (!state.cur) {
+			afd = audio_tryget(af);
+			if (!afd)
+				break;
+
+			if (state.want_flush) {
+				state.want_flush = 0;
+				audio_clock_wrote(af, added - state.fill);
+				state.fill = 0;
+				added = 0;
+			}
+
+			state.cur = afd;
+			state.pos = 0;
+		}
+
+		if (state.cur->rate != state.rate || state.cur->channels != state.channels) {
+			/* Play out the old format first */
+			if (state.fill || state.running)
+				break;
+			dummy_format(af, state.cur);
+		}
+
+		if (state.fill == state.buffer)
+			break;
+
+		if (!state.pos)
+			audio_clock_anchor(af, state.cur, added);
+
+		n = state.cur->nsamples - state.pos;
+		if (n > state.buffer - state.fill)
+			n = state.buffer - state.fill;
+
+		state.fill += n;
+		state.pos += n;
+		added += n;
+
+		if (state.pos == state.cur->nsamples) {
+			audio_fifo_free(af, state.cur);
+			state.cur = NULL;
+		}
+	}
 
-	pthread_mutex_lock(&af->mutex);
+	audio_clock_wrote(af, added);
+}
+
+/**
+ * Let the device take a period for every tick that has passed by \p now.
+ * A tick that finds less than a period is an underrun, and the device
+ * stops until it is given audio again.
+ */
+static void dummy_play(int64_t now)
+{
+	int64_t due;
+
+	if (!state.running)
+		return;
+
+	due = (now - state.start_ns) / period_ns();
 
-	while((afd = TAILQ_FIRST(&af->q))) {
-		TAILQ_REMOVE(&af->q, afd, link);
-		free(afd);
+	while (state.running && state.ticks < due) {
+		state.ticks++;
+
+		if (state.fill < state.period) {
+			state.played += state.fill;
+			state.fill = 0;
+			state.running = 0;
+
+			/* Running out before a format change is a drain, not an underrun */
+			if (!state.cur || (state.cur->rate == state.rate &&
+			                   state.cur->channels == state.channels))
+				state.underruns++;
+			break;
+		}
+
+		state.fill -= state.period;
+		state.played += state.period;
 	}
+}
 
-	af->qlen = 0;
-	pthread_mutex_unlock(&af->mutex);
+/**
+ * Log underruns, wakeup lateness and queue depths every ten seconds.
+ */
+static void dummy_stats(audio_fifo_t *af, int64_t now)
+{
+	int64_t t = now - state.stats_ns;
+
+	if (t < 10000000000LL || !state.rate)
+		return;
+
+	fprintf(stderr, "audio: dummy took %.1f%% of real time, %d underruns, %.1f wakeups/s, "
+	        "woke %d us after the tick on average and %d us at worst\n",
+	        state.played * 1e11 / state.rate / t, state.underruns,
+	        state.wakeups * 1e9 / t,
+	        state.timed ? (int)(state.late_ns / state.timed / 1000) : 0,
+	        (int)(state.late_max_ns / 1000));
+	fprintf(stderr, "audio: fifo depth %d/%d/%d ms (min/avg/max), device down to %d ms\n",
+	        state.depth_min * 1000 / state.rate,
+	        state.wakeups ? (int)(state.depth_sum / state.wakeups * 1000 / state.rate) : 0,
+	        state.depth_max * 1000 / state.rate,
+	        state.fill_min == INT_MAX ? 0 : state.fill_min * 1000 / state.rate);
+
+	state.stats_ns = now;
+	state.underruns = 0;
+	state.wakeups = 0;
+	state.late_ns = 0;
+	state.late_max_ns = 0;
+	state.timed = 0;
+	state.played = 0;
+	state.depth_min = INT_MAX;
+	state.depth_max = 0;
+	state.depth_sum = 0;
+	state.fill_min = INT_MAX;
 }
 
+/**
+ * Fifo hooks, run on the driver thread from within audio_fifo_control()
+ * or audio_tryget().
+ */
+static void dummy_pause(int pause)
+{
+	/* Stop the clock at what the device had played by now */
+	if (pause) {
+		dummy_play(now_ns());
+		audio_clock_sync(state.af, state.fill, 0);
+	}
+
+	/* A resumed device starts ticking afresh */
+	state.running = 0;
+}
+
+static void dummy_flush(void)
+{
+	state.want_flush = 1;
+}
+
+/**
+ * Sleep until \p wake on CLOCK_MONOTONIC, or until the fifo signals a
+ * flush, pause or shutdown.
+ *
+ * @return 1 if the time came, 0 if the fifo woke us first
+ */
+static int dummy_sleep(audio_fifo_t *af, int64_t wake)
+{
+	struct itimerspec its = { { 0, 0 }, { wake / 1000000000, wake % 1000000000 } };
+	struct timespec ts = its.it_value;
+	struct pollfd pfd[2];
+	uint64_t expired;
+
+	/* Without a timer, or nothing to poll() besides it, sleep right through */
+	if (state.tfd < 0 || af->efd < 0) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+		return 1;
+	}
+
+	timerfd_settime(state.tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+	pfd[0].fd = af->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = state.tfd;
+	pfd[1].events = POLLIN;
+
+	while (poll(pfd, 2, -1) < 0 && errno == EINTR)
+		;
+
+	if (pfd[0].revents & POLLIN)
+		audio_fifo_disarm(af, 0);
+
+	if (!(pfd[1].revents & POLLIN))
+		return 0;
+
+	if (read(state.tfd, &expired, sizeof(expired)) < 0)
+		expired = 0;
+	return 1;
+}
+
+/**
+ * The driver thread. While the device runs it sleeps until the next tick,
+ * plus a random lateness of up to sim_jitter_ms, or until the fifo has a
+ * command for it; then plays the ticks that have passed and tops the
+ * device up. Otherwise it sleeps on the fifo.
+ */
+static void* dummy_audio_start(void *aux)
+{
+	audio_fifo_t *af = aux;
+	struct pollfd pfd;
+	int64_t now, tick, wake;
+	int paused, preroll, timeout, r;
+
+	pfd.fd = af->efd;
+	pfd.events = POLLIN;
+	state.stats_ns = now_ns();
+	state.depth_min = INT_MAX;
+	state.fill_min = INT_MAX;
+
+	while (!af->shutdown) {
+		paused = audio_fifo_control(af);
+		now = now_ns();
+
+		if (state.want_flush) {
+			state.want_flush = 0;
+			audio_clock_wrote(af, -state.fill);
+			state.fill = 0;
+			state.running = 0;
+			if (state.cur) {
+				audio_fifo_free(af, state.cur);
+				state.cur = NULL;
+			}
+		}
+
+		if (!paused) {
+			dummy_play(now);
+
+			if (state.running && state.fill < state.fill_min)
+				state.fill_min = state.fill;
+
+			dummy_top_up(af);
+
+			if (!state.running && state.fill) {
+				state.running = 1;
+				state.start_ns = now;
+				state.ticks = 0;
+			}
+
+			audio_clock_sync(af, state.fill, state.running);
+		}
+
+		state.wakeups++;
+		state.depth_sum += af->qlen;
+		if (af->qlen < state.depth_min)
+			state.depth_min = af->qlen;
+		if (af->qlen > state.depth_max)
+			state.depth_max = af->qlen;
+
+		dummy_stats(af, now);
+
+		if (!paused && state.running) {
+			/* Sleep until the next tick, as late as the scheduler might be */
+			tick = state.start_ns + (state.ticks + 1) * period_ns();
+			wake = tick;
+			if (af->sim_jitter_ms > 0)
+				wake += (int64_t)(rand() % (af->sim_jitter_ms * 1000)) * 1000;
+
+			if (!dummy_sleep(af, wake))
+				continue;
+
+			now = now_ns() - tick;
+			state.late_ns += now;
+			if (now > state.late_max_ns)
+				state.late_max_ns = now;
+			state.timed++;
+			continue;
+		}
+
+		/* Stopped, sleep on the fifo alone, or check it now and then without an eventfd */
+		preroll = audio_fifo_arm(af);
+		timeout = preroll;
+		if (af->efd < 0 && (timeout < 0 || timeout > FALLBACK_POLL_MS))
+			timeout = FALLBACK_POLL_MS;
+
+		r = timeout ? poll(&pfd, 1, timeout) : 1;
+		audio_fifo_disarm(af, r == 0 && timeout == preroll);
+	}
+
+	af->shutdown = 2;
+	return NULL;
+}
+
+/// The device options this driver reads
+const char audio_driver_options[] = "PbJ";
+
+void audio_init(audio_fifo_t *af)
+{
+	pthread_t tid;
+
+	audio_fifo_init(af);
+	af->on_pause = dummy_pause;
+	af->on_flush = dummy_flush;
+	state.af = af;
+
+	if (audio_fifo_eventfd(af) >= 0)
+		state.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	else
+		state.tfd = -1;
+
+	pthread_create(&tid, NULL, dummy_audio_start, af);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * epoll main loop, see evloop.h.
+ *
+ * Timeouts are kept on a CLOCK_MONOTONIC timerfd rather than computed into
+ * a CLOCK_REALTIME deadline, so a wall clock step can neither stall the loop
+ * nor make it spin, and the kernel normalizes the expiry for us.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "evloop.h"
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int evloop_watch(evloop_t *el, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(el->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Set up \p el with its notifications and timer.
+ *
+ * @return 0, or -1 with errno set
+ */
+int evloop_init(evloop_t *el)
+{
+	memset(el, 0, sizeof(*el));
+	el->tfd = el->sfd = -1;
+	sigemptyset(&el->sigs);
+	el->stats_ns = now_ns();
+
+	el->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (el->epfd < 0)
+		return -1;
+
+	el->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (notify_init(&el->notify) < 0 || el->tfd < 0)
+		return -1;
+
+	if (evloop_watch(el, el->notify.fd) < 0 || evloop_watch(el, el->tfd) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Wake the loop with \p bits, which the next evloop_wait() leaves in
+ * el->posted. Safe to call from any thread, and from signal handlers.
+ */
+void evloop_notify(evloop_t *el, uint32_t bits)
+{
+	notify_post(&el->notify, bits);
+}
+
+/**
+ * Have the loop wake in \p ms milliseconds, replacing any earlier timeout.
+ * 0 wakes it at once, a negative value cancels the timeout.
+ */
+void evloop_timeout(evloop_t *el, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	if (ms > 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	} else if (ms == 0) {
+		/* An all zero it_value would disarm the timer instead */
+		its.it_value.tv_nsec = 1;
+	}
+
+	timerfd_settime(el->tfd, 0, &its, NULL);
+}
+
+/**
+ * Call \p cb on the loop whenever \p fd is readable, for control sockets
+ * and the like.
+ *
+ * @return 0, or -1 with errno set
+ */
+int evloop_add(evloop_t *el, int fd, evloop_fd_cb_t cb, void *aux)
+{
+	struct evloop_fd *w;
+
+	if (el->nfds == EVLOOP_MAX_FDS) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	if (evloop_watch(el, fd) < 0)
+		return -1;
+
+	w = &el->fds[el->nfds++];
+	w->fd = fd;
+	w->cb = cb;
+	w->aux = aux;
+	return 0;
+}
+
+/**
+ * Stop watching \p fd. The caller still owns it and closes it.
+ */
+void evloop_remove(evloop_t *el, int fd)
+{
+	int i;
+
+	for (i = 0; i < el->nfds; ++i) {
+		if (el->fds[i].fd != fd)
+			continue;
+
+		epoll_ctl(el->epfd, EPOLL_CTL_DEL, fd, NULL);
+		el->fds[i] = el->fds[--el->nfds];
+		return;
+	}
+}
+
+/**
+ * Deliver the signals in \p set to \p cb on the loop, instead of to
+ * handlers. The signals are blocked in the calling thread, so this must be
+ * called before any other thread is started, for them to inherit the mask.
+ * Calling it again adds to the set and replaces the callback.
+ *
+ * @return 0, or -1 with errno set
+ */
+int evloop_signals(evloop_t *el, const sigset_t *set, evloop_signal_cb_t cb, void *aux)
+{
+	int signo, fd;
+
+	for (signo = 1; signo < NSIG; ++signo)
+		if (sigismember(set, signo) == 1)
+			sigaddset(&el->sigs, signo);
+
+	errno = pthread_sigmask(SIG_BLOCK, &el->sigs, NULL);
+	if (errno)
+		return -1;
+
+	fd = signalfd(el->sfd, &el->sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (el->sfd < 0 && evloop_watch(el, fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	el->sfd = fd;
+	el->on_signal = cb;
+	el->signal_aux = aux;
+	return 0;
+}
+
+/**
+ * Read pending signals and hand them to the callback.
+ */
+static void evloop_read_signals(evloop_t *el)
+{
+	struct signalfd_siginfo si;
+
+	while (read(el->sfd, &si, sizeof(si)) == sizeof(si))
+		if (el->on_signal)
+			el->on_signal(el, si.ssi_signo, el->signal_aux);
+}
+
+/**
+ * Sleep until the loop is notified, the timeout runs out, or a watched fd
+ * or signal needs handling, and run the callbacks for those. Any timeout
+ * that ran out is gone, arm another with evloop_timeout() as needed.
+ *
+ * @return A mask of EVLOOP_NOTIFY, EVLOOP_TIMEOUT and EVLOOP_IO, 0 if
+ *         interrupted, or -1 with errno set
+ */
+int evloop_wait(evloop_t *el)
+{
+	struct epoll_event ev[EVLOOP_MAX_FDS + 3];
+	uint64_t n;
+	int i, k, fd, nev, woke = 0;
+
+	nev = epoll_wait(el->epfd, ev, sizeof(ev) / sizeof(ev[0]), -1);
+	if (nev < 0)
+		return errno == EINTR ? 0 : -1;
+
+	el->wakeups++;
+	el->posted = 0;
+
+	for (i = 0; i < nev; ++i) {
+		fd = ev[i].data.fd;
+
+		if (fd == el->notify.fd) {
+			el->posted = notify_take(&el->notify);
+			if (el->posted)
+				woke |= EVLOOP_NOTIFY;
+		} else if (fd == el->tfd) {
+			if (read(fd, &n, sizeof(n)) == sizeof(n))
+				woke |= EVLOOP_TIMEOUT;
+		} else if (fd == el->sfd) {
+			evloop_read_signals(el);
+			woke |= EVLOOP_IO;
+		} else {
+			for (k = 0; k < el->nfds; ++k) {
+				if (el->fds[k].fd == fd) {
+					el->fds[k].cb(el, fd, el->fds[k].aux);
+					woke |= EVLOOP_IO;
+					break;
+				}
+			}
+		}
+	}
+
+	if (woke & EVLOOP_NOTIFY)
+		el->notifies++;
+	if (woke & EVLOOP_TIMEOUT)
+		el->timeouts++;
+
+	return woke;
+}
+
+/**
+ * Log how often the loop woke up since the last call, and start over.
+ *
+ * @return Wakeups per second over that time
+ */
+double evloop_stats(evloop_t *el)
+{
+	int64_t now = now_ns();
+	double t = (now - el->stats_ns) / 1e9;
+	double rate = t > 0 ? el->wakeups / t : 0;
+	unsigned posts, signalled;
+
+	notify_stats(&el->notify, &posts, &signalled);
+	fprintf(stderr, "loop: %.1f wakeups/s over %.0f s, %u notified, %u timed out\n",
+	        rate, t, el->notifies, el->timeouts);
+	fprintf(stderr, "loop: %u notifications coalesced into %u signals\n",
+	        posts, signalled);
+
+	el->wakeups = 0;
+	el->notifies = 0;
+	el->timeouts = 0;
+	el->stats_ns = now;
+	return rate;
+}
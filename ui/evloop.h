@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Main loop for the front-ends without GTK, built on epoll.
+ *
+ * Other threads wake the loop by posting event bits (see notify.h), the
+ * session's next_timeout is kept on a CLOCK_MONOTONIC timerfd, and further
+ * fds and signals (through a signalfd) can be watched alongside.
+ */
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "notify.h"
+
+/// Most fds evloop_add() can watch
+#define EVLOOP_MAX_FDS 8
+
+/* --- Types --- */
+struct evloop;
+
+/// Called when a watched fd is readable, or has an error or hangup
+typedef void (*evloop_fd_cb_t)(struct evloop *el, int fd, void *aux);
+/// Called on the loop for each signal the signalfd delivers
+typedef void (*evloop_signal_cb_t)(struct evloop *el, int signo, void *aux);
+
+/// What woke evloop_wait(), as a mask
+enum {
+	EVLOOP_NOTIFY = 1,	///< evloop_notify() was called
+	EVLOOP_TIMEOUT = 2,	///< The evloop_timeout() ran out
+	EVLOOP_IO = 4,		///< A watched fd or a signal was handled
+};
+
+typedef struct evloop {
+	int epfd;
+	notify_t notify;		///< Posted to by evloop_notify()
+	uint32_t posted;		///< Bits the last evloop_wait() took from notify
+	int tfd;			///< CLOCK_MONOTONIC timer for evloop_timeout()
+	int sfd;			///< signalfd, -1 until evloop_signals()
+	sigset_t sigs;			///< Signals read from sfd
+	evloop_signal_cb_t on_signal;
+	void *signal_aux;
+	struct evloop_fd {
+		int fd;
+		evloop_fd_cb_t cb;
+		void *aux;
+	} fds[EVLOOP_MAX_FDS];
+	int nfds;
+	unsigned wakeups;		///< Returns from epoll_wait() since evloop_stats()
+	unsigned notifies;		///< Of those, ones the eventfd took part in
+	unsigned timeouts;		///< Ones the timer took part in
+	int64_t stats_ns;		///< When the counters were last reset
+} evloop_t;
+
+/* --- Functions --- */
+extern int evloop_init(evloop_t *el);
+extern void evloop_notify(evloop_t *el, uint32_t bits);
+extern void evloop_timeout(evloop_t *el, int ms);
+extern int evloop_add(evloop_t *el, int fd, evloop_fd_cb_t cb, void *aux);
+extern void evloop_remove(evloop_t *el, int fd);
+extern int evloop_signals(evloop_t *el, const sigset_t *set, evloop_signal_cb_t cb, void *aux);
+extern int evloop_wait(evloop_t *el);
+extern double evloop_stats(evloop_t *el);
+
+#endif /* _EVLOOP_H_ */
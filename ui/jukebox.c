@@ -29,17 +29,18 @@
 
 #include <errno.h>
 #include <libgen.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 
 #include <libspotify/api.h>
 
 #include "audio.h"
+#include "evloop.h"
+#include "options.h"
+#include "process.h"
 
 
 /* --- Data --- */
@@ -51,14 +52,10 @@ extern const size_t g_appkey_size;
 
 /// The output queue for audo data
 static audio_fifo_t g_audiofifo;
-/// Synchronization mutex for the main thread
-static pthread_mutex_t g_notify_mutex;
-/// Synchronization condition variable for the main thread
-static pthread_cond_t g_notify_cond;
-/// Synchronization variable telling the main thread to process events
-static int g_notify_do;
-/// Non-zero when a track has ended and the jukebox has not yet started a new one
-static int g_playback_done;
+/// The main loop, woken by the session callbacks
+static evloop_t g_loop;
+/// Time budget and histogram for session event processing
+static process_budget_t g_process = { .budget_ms = PROCESS_BUDGET_MS };
 /// The global session handle
 static sp_session *g_sess;
 /// Handle to the playlist currently being played
@@ -71,6 +68,8 @@ static int g_remove_tracks = 0;
 static sp_track *g_currenttrack;
 /// Index to the next track
 static int g_track_index;
+/// Gapless playback, volume and ReplayGain from the command line
+static audio_options_t g_audioopts = { .volume = 100 };
 
 
 /**
@@ -118,8 +117,13 @@ static void try_jukebox_start(void)
 	printf("jukebox: Now playing \"%s\"...\n", sp_track_name(t));
 	fflush(stdout);
 
+	audio_fifo_mark_track(&g_audiofifo);
 	sp_session_player_load(g_sess, t);
 	sp_session_player_play(g_sess, 1);
+
+	/* Have the next track ready so it can follow without a gap */
+	if (g_audioopts.gapless && g_track_index + 1 < sp_playlist_num_tracks(g_jukeboxlist))
+		sp_session_player_prefetch(g_sess, sp_playlist_track(g_jukeboxlist, g_track_index + 1));
 }
 
 /* --------------------------  PLAYLIST CALLBACKS  ------------------------- */
@@ -273,6 +277,10 @@ static void container_loaded(sp_playlistcontainer *pc, void *userdata)
 {
 	fprintf(stderr, "jukebox: Rootlist synchronized (%d playlists)\n",
 	    sp_playlistcontainer_num_playlists(pc));
+
+	/* What the sync's notification storm cost */
+	evloop_stats(&g_loop);
+	process_stats(&g_process);
 }
 
 
@@ -326,16 +334,14 @@ static void logged_in(sp_session *sess, sp_error error)
  * This callback is called from an internal libspotify thread to ask us to
  * reiterate the main loop.
  *
- * We notify the main thread using a condition variable and a protected variable.
+ * We post NOTIFY_EVENTS to the main loop, without taking a lock. A burst of
+ * these before the loop gets to run wakes it once.
  *
  * @sa sp_session_callbacks#notify_main_thread
  */
 static void notify_main_thread(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_notify_do = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	evloop_notify(&g_loop, NOTIFY_EVENTS);
 }
 
 /**
@@ -346,39 +352,11 @@ static void notify_main_thread(sp_session *sess)
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
-	audio_fifo_t *af = &g_audiofifo;
-	audio_fifo_data_t *afd;
-	size_t s;
-
 	if (num_frames == 0)
 		return 0; // Audio discontinuity, do nothing
 
-	pthread_mutex_lock(&af->mutex);
-
-	/* Buffer one second of audio */
-	if (af->qlen > format->sample_rate) {
-		pthread_mutex_unlock(&af->mutex);
-
-		return 0;
-	}
-
-	s = num_frames * sizeof(int16_t) * format->channels;
-
-	afd = malloc(sizeof(audio_fifo_data_t) + s);
-	memcpy(afd->samples, frames, s);
-
-	afd->nsamples = num_frames;
-
-	afd->rate = format->sample_rate;
-	afd->channels = format->channels;
-
-	TAILQ_INSERT_TAIL(&af->q, afd, link);
-	af->qlen += num_frames;
-
-	pthread_cond_signal(&af->cond);
-	pthread_mutex_unlock(&af->mutex);
-
-	return num_frames;
+	return audio_fifo_put(&g_audiofifo, frames, num_frames,
+	                      format->channels, format->sample_rate);
 }
 
 
@@ -389,10 +367,7 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
  */
 static void end_of_track(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_playback_done = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	evloop_notify(&g_loop, NOTIFY_END_OF_TRACK);
 }
 
 
@@ -425,6 +400,38 @@ static void play_token_lost(sp_session *sess)
 	}
 }
 
+/**
+ * Callback from libspotify asking how much audio we have queued and how
+ * many times the driver ran dry since it last asked.
+ *
+ * @sa sp_session_callbacks#get_audio_buffer_stats
+ */
+static void get_audio_buffer_stats(sp_session *sess, sp_audio_buffer_stats *stats)
+{
+	audio_fifo_stats(&g_audiofifo, &stats->samples, &stats->stutter);
+}
+
+/**
+ * Callback from libspotify, audio playback should (re)start.
+ *
+ * @sa sp_session_callbacks#start_playback
+ */
+static void start_playback(sp_session *sess)
+{
+	audio_fifo_pause(&g_audiofifo, 0);
+}
+
+/**
+ * Callback from libspotify, audio playback should stop. The driver stops
+ * consuming until start_playback() is called.
+ *
+ * @sa sp_session_callbacks#stop_playback
+ */
+static void stop_playback(sp_session *sess)
+{
+	audio_fifo_pause(&g_audiofifo, 1);
+}
+
 /**
  * The session callbacks
  */
@@ -436,6 +443,9 @@ static sp_session_callbacks session_callbacks = {
 	.play_token_lost = &play_token_lost,
 	.log_message = NULL,
 	.end_of_track = &end_of_track,
+	.start_playback = &start_playback,
+	.stop_playback = &stop_playback,
+	.get_audio_buffer_stats = &get_audio_buffer_stats,
 };
 
 /**
@@ -458,7 +468,8 @@ static sp_session_config spconfig = {
 /**
  * A track has ended. Remove it from the playlist.
  *
- * Called from the main loop when the music_delivery() callback has set g_playback_done.
+ * Called from the main loop when the end_of_track() callback has posted
+ * NOTIFY_END_OF_TRACK.
  */
 static void track_ended(void)
 {
@@ -466,7 +477,9 @@ static void track_ended(void)
 
 	if (g_currenttrack) {
 		g_currenttrack = NULL;
-		sp_session_player_unload(g_sess);
+		/* In gapless mode the next load simply replaces the track */
+		if (!g_audioopts.gapless)
+			sp_session_player_unload(g_sess);
 		if (g_remove_tracks) {
 			sp_playlist_remove_tracks(g_jukeboxlist, &tracks, 1);
 		} else {
@@ -476,6 +489,23 @@ static void track_ended(void)
 	}
 }
 
+/**
+ * Signals, taken on the main loop through a signalfd. SIGINT and SIGTERM
+ * let the driver close the device before we exit, SIGUSR1 logs how often
+ * the loop wakes up and how long event processing takes.
+ */
+static void on_signal(evloop_t *el, int signo, void *aux)
+{
+	if (signo == SIGUSR1) {
+		evloop_stats(el);
+		process_stats(&g_process);
+		return;
+	}
+
+	audio_fifo_shutdown(&g_audiofifo);
+	exit(0);
+}
+
 /**
  * Show usage information
  *
@@ -483,8 +513,12 @@ static void track_ended(void)
  */
 static void usage(const char *progname)
 {
-	fprintf(stderr, "usage: %s -u <username> -p <password> -l <listname> [-d]\n", progname);
+	fprintf(stderr, "usage: %s -u <username> -p <password> -l <listname> [-d]", progname);
+	audio_synopsis(stderr);
+	fprintf(stderr, " [-E <ms>]\n");
 	fprintf(stderr, "warning: -d will delete the tracks played from the list!\n");
+	audio_help(stderr);
+	fprintf(stderr, "  -E  process session events for at most this many ms before other work gets a turn, 0 for no limit\n");
 }
 
 int main(int argc, char **argv)
@@ -493,11 +527,12 @@ int main(int argc, char **argv)
 	sp_session *sp;
 	sp_error err;
 	int next_timeout = 0;
+	sigset_t sigs;
 	const char *username = NULL;
 	const char *password = NULL;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "u:p:l:d")) != EOF) {
+	while ((opt = getopt(argc, argv, audio_optstring("u:p:l:dE:"))) != EOF) {
 		switch (opt) {
 		case 'u':
 			username = optarg;
@@ -515,7 +550,14 @@ int main(int argc, char **argv)
 			g_remove_tracks = 1;
 			break;
 
+		case 'E':
+			g_process.budget_ms = atoi(optarg);
+			break;
+
 		default:
+			if (audio_option(&g_audiofifo, &g_audioopts, opt, optarg) > 0)
+				break;
+			usage(basename(argv[0]));
 			exit(1);
 		}
 	}
@@ -525,7 +567,18 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* Before any thread starts, so they all leave these signals to us */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	if (evloop_init(&g_loop) < 0 || evloop_signals(&g_loop, &sigs, on_signal, NULL) < 0) {
+		perror("evloop");
+		exit(1);
+	}
+
 	audio_init(&g_audiofifo);
+	audio_fifo_set_gain(&g_audiofifo, g_audioopts.volume, g_audioopts.replaygain);
 
 	/* Create session */
 	spconfig.application_key_size = g_appkey_size;
@@ -540,50 +593,25 @@ int main(int argc, char **argv)
 
 	g_sess = sp;
 
-	pthread_mutex_init(&g_notify_mutex, NULL);
-	pthread_cond_init(&g_notify_cond, NULL);
-
 	sp_playlistcontainer_add_callbacks(
 		sp_session_playlistcontainer(g_sess),
 		&pc_callbacks,
 		NULL);
 
 	sp_session_login(sp, username, password);
-	pthread_mutex_lock(&g_notify_mutex);
 
 	for (;;) {
-		if (next_timeout == 0) {
-			while(!g_notify_do && !g_playback_done)
-				pthread_cond_wait(&g_notify_cond, &g_notify_mutex);
-		} else {
-			struct timespec ts;
-
-#if _POSIX_TIMERS > 0
-			clock_gettime(CLOCK_REALTIME, &ts);
-#else
-			struct timeval tv;
-			gettimeofday(&tv, NULL);
-			TIMEVAL_TO_TIMESPEC(&tv, &ts);
-#endif
-			ts.tv_sec += next_timeout / 1000;
-			ts.tv_nsec += (next_timeout % 1000) * 1000000;
-
-			pthread_cond_timedwait(&g_notify_cond, &g_notify_mutex, &ts);
+		if (evloop_wait(&g_loop) < 0) {
+			perror("epoll_wait");
+			exit(1);
 		}
 
-		g_notify_do = 0;
-		pthread_mutex_unlock(&g_notify_mutex);
-
-		if (g_playback_done) {
+		if (g_loop.posted & NOTIFY_END_OF_TRACK)
 			track_ended();
-			g_playback_done = 0;
-		}
-
-		do {
-			sp_session_process_events(sp, &next_timeout);
-		} while (next_timeout == 0);
 
-		pthread_mutex_lock(&g_notify_mutex);
+		/* Out of budget, the timer fires at once after a look at the rest */
+		next_timeout = process_events(&g_process, sp);
+		evloop_timeout(&g_loop, next_timeout);
 	}
 
 	return 0;
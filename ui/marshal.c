@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * UI update queue, see marshal.h.
+ */
+
+#include <stdlib.h>
+
+#include "marshal.h"
+
+/**
+ * Queue an update. Safe from any thread; never takes a lock.
+ *
+ * @return 1 if the queue was empty, and the consumer needs to be scheduled,
+ *         0 if it already is, or -1 if out of memory
+ */
+int marshal_post(marshal_t *m, int kind, void *key)
+{
+	marshal_msg_t *msg = malloc(sizeof(*msg));
+	marshal_msg_t *head;
+
+	if (!msg)
+		return -1;
+
+	msg->kind = kind;
+	msg->key = key;
+
+	do {
+		head = m->head;
+		msg->next = head;
+	} while (!__sync_bool_compare_and_swap(&m->head, head, msg));
+
+	__sync_fetch_and_add(&m->posts, 1);
+	return head == NULL;
+}
+
+/**
+ * Take every queued message, on the consumer's thread.
+ *
+ * @return The messages oldest first, or NULL. Free with marshal_free().
+ */
+marshal_msg_t *marshal_take(marshal_t *m)
+{
+	marshal_msg_t *msg, *next, *list = NULL;
+
+	do {
+		msg = m->head;
+	} while (!__sync_bool_compare_and_swap(&m->head, msg, NULL));
+
+	/* The stack is newest first, turn it around */
+	for (; msg; msg = next) {
+		next = msg->next;
+		msg->next = list;
+		list = msg;
+	}
+
+	return list;
+}
+
+void marshal_free(marshal_msg_t *list)
+{
+	marshal_msg_t *next;
+
+	for (; list; list = next) {
+		next = list->next;
+		free(list);
+	}
+}
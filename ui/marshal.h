@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Multi-producer, single-consumer queue of update messages for the UI.
+ *
+ * Producers push onto a lock-free stack. The consumer takes the whole stack
+ * in one go and gets it back in posting order, so it can merge the messages
+ * of a burst before it touches any widget.
+ */
+#ifndef _MARSHAL_H_
+#define _MARSHAL_H_
+
+/* --- Types --- */
+typedef struct marshal_msg {
+	struct marshal_msg *next;
+	int kind;			///< What to update, up to the consumer
+	void *key;			///< Which object to update it for
+} marshal_msg_t;
+
+typedef struct marshal {
+	marshal_msg_t * volatile head;	///< Newest message first
+	volatile unsigned posts;	///< marshal_post() calls, for the consumer's stats
+} marshal_t;
+
+/* --- Functions --- */
+extern int marshal_post(marshal_t *m, int kind, void *key);
+extern marshal_msg_t *marshal_take(marshal_t *m);
+extern void marshal_free(marshal_msg_t *list);
+
+#endif /* _MARSHAL_H_ */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Coalescing main loop notifications, see notify.h.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "notify.h"
+
+/**
+ * Set up \p n with an empty mask.
+ *
+ * @return The eventfd to poll, or -1 with errno set
+ */
+int notify_init(notify_t *n)
+{
+	memset(n, 0, sizeof(*n));
+	n->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	return n->fd;
+}
+
+/**
+ * Post \p bits for the main loop. Safe from any thread and from signal
+ * handlers; never blocks or takes a lock.
+ */
+void notify_post(notify_t *n, uint32_t bits)
+{
+	uint64_t one = 1;
+
+	__sync_fetch_and_add(&n->posts, 1);
+
+	/* Someone already woke the loop, and it has yet to take the mask */
+	if (__sync_fetch_and_or(&n->pending, bits))
+		return;
+
+	__sync_fetch_and_add(&n->wakeups, 1);
+	if (write(n->fd, &one, sizeof(one)) < 0)
+		return;	/* Counter saturated, the loop is awake anyway */
+}
+
+/**
+ * Take the posted bits, on the main loop. The eventfd is drained before the
+ * mask is cleared, so a post racing with us either lands in what we return
+ * or signals the eventfd afresh.
+ *
+ * @return The bits posted since the last call, 0 if none
+ */
+uint32_t notify_take(notify_t *n)
+{
+	uint64_t v;
+
+	if (read(n->fd, &v, sizeof(v)) < 0)
+		v = 0;
+
+	return __sync_fetch_and_and(&n->pending, 0);
+}
+
+/**
+ * Report how many notifications were posted and how many wakeups they
+ * cost since the last call, and start counting afresh.
+ */
+void notify_stats(notify_t *n, unsigned *posts, unsigned *wakeups)
+{
+	*posts = __sync_lock_test_and_set(&n->posts, 0);
+	*wakeups = __sync_lock_test_and_set(&n->wakeups, 0);
+}
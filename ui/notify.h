@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Lock-free wakeups for the main loop.
+ *
+ * Any thread posts event bits into an atomic mask. Only the post that
+ * finds the mask empty signals the eventfd, so a burst of notifications
+ * between two turns of the loop costs one write and one wakeup.
+ */
+#ifndef _NOTIFY_H_
+#define _NOTIFY_H_
+
+#include <stdint.h>
+
+/* --- Types --- */
+/// Bits the front-ends post from the session callbacks
+enum {
+	NOTIFY_EVENTS = 1,		///< notify_main_thread(), process events
+	NOTIFY_END_OF_TRACK = 2,	///< end_of_track(), start the next one
+};
+
+typedef struct notify {
+	int fd;				///< eventfd for the main loop to poll
+	volatile uint32_t pending;	///< Bits posted since the last notify_take()
+	volatile unsigned posts;	///< notify_post() calls since notify_stats()
+	volatile unsigned wakeups;	///< Of those, ones that signalled fd
+} notify_t;
+
+/* --- Functions --- */
+extern int notify_init(notify_t *n);
+extern void notify_post(notify_t *n, uint32_t bits);
+extern uint32_t notify_take(notify_t *n);
+extern void notify_stats(notify_t *n, unsigned *posts, unsigned *wakeups);
+
+#endif /* _NOTIFY_H_ */
@@ -25,142 +25,419 @@
  * This file is part of the libspotify examples suite.
  */
 
+#ifdef __APPLE__
 #include <OpenAL/al.h>
 #include <OpenAL/alc.h>
+#else
+#include <AL/al.h>
+#include <AL/alc.h>
+#endif
 #include <errno.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/time.h>
 
 #include "audio.h"
 
-#define NUM_BUFFERS 3
+/// Buffers queued on the source, unless -b and -P say otherwise
+#define NUM_BUFFERS 4
+/// Length of each buffer, unless -P says otherwise
+#define BUFFER_MS 50
+/// Most buffers the source is given
+#define MAX_BUFFERS 64
+/// Longest sleep where there is no eventfd to wake us early
+#define FALLBACK_POLL_MS 10
+
+static struct openal_state {
+	ALCdevice *device;
+	ALuint source;		/* The source being played, touched only from the driver thread */
+	ALuint buffers[MAX_BUFFERS];
+	int nbuffers;		/* Buffers in use for the current format */
+	int frames;		/* Frames per buffer likewise */
+	ALuint free[MAX_BUFFERS];	/* Buffers not queued on the source */
+	int nfree;
+	int queued[MAX_BUFFERS];	/* Frames in each queued buffer, a ring from qhead */
+	int qhead;
+	int qlen;
+
+	int rate;		/* Format of what is staged and queued */
+	int channels;
+	int16_t *stage;		/* Buffer being assembled from fifo chunks */
+	int staged;		/* Frames in stage */
+
+	audio_fifo_data_t *cur;	/* Chunk being copied into stage */
+	int pos;		/* Frames of cur already copied */
+
+	int want_flush;		/* Fifo was flushed, drop what the source holds */
+	audio_fifo_t *af;
+
+	int64_t stats_us;	/* Start of the current stats interval */
+	double stats_cpu;	/* Thread CPU time at stats_us, in ms */
+	int wakeups;		/* Returns from poll() in the interval */
+	int submits;		/* Buffers queued in the interval */
+} state;
 
 static void error_exit(const char *msg)
 {
-    puts(msg);
-    exit(1);
+	puts(msg);
+	exit(1);
+}
+
+static double cpu_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * Frames the source has not played yet, from its offset into the oldest
+ * buffer still queued.
+ */
+static int openal_pending(void)
+{
+	ALint offset = 0;
+	int i, n = 0;
+
+	for (i = 0; i < state.qlen; ++i)
+		n += state.queued[(state.qhead + i) % MAX_BUFFERS];
+
+	if (state.qlen)
+		alGetSourcei(state.source, AL_SAMPLE_OFFSET, &offset);
+
+	return n > offset ? n - offset : 0;
+}
+
+/**
+ * Take buffers the source has finished with back into the free list.
+ */
+static void openal_reclaim(void)
+{
+	ALuint ids[MAX_BUFFERS];
+	ALint processed = 0;
+	int i;
+
+	alGetSourcei(state.source, AL_BUFFERS_PROCESSED, &processed);
+	if (processed <= 0)
+		return;
+
+	alSourceUnqueueBuffers(state.source, processed, ids);
+
+	for (i = 0; i < processed; ++i)
+		state.free[state.nfree++] = ids[i];
+
+	state.qhead = (state.qhead + processed) % MAX_BUFFERS;
+	state.qlen -= processed;
+}
+
+/**
+ * Queue the staged frames on the source in a free buffer.
+ */
+static void openal_submit(audio_fifo_t *af)
+{
+	ALuint id = state.free[--state.nfree];
+
+	alBufferData(id, state.channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16,
+	             state.stage, state.staged * state.channels * sizeof(int16_t), state.rate);
+	alSourceQueueBuffers(state.source, 1, &id);
+
+	state.queued[(state.qhead + state.qlen++) % MAX_BUFFERS] = state.staged;
+	audio_clock_wrote(af, state.staged);
+	state.staged = 0;
+	state.submits++;
+}
+
+/**
+ * Drop everything queued, staged or in hand, as asked by a flush.
+ */
+static void openal_flush(audio_fifo_t *af)
+{
+	int i;
+
+	state.want_flush = 0;
+
+	/* What the source held is never heard */
+	audio_clock_wrote(af, -openal_pending());
+
+	alSourceStop(state.source);
+	alSourcei(state.source, AL_BUFFER, 0);
+
+	state.nfree = 0;
+	for (i = 0; i < state.nbuffers; ++i)
+		state.free[state.nfree++] = state.buffers[i];
+	state.qlen = 0;
+	state.staged = 0;
+
+	if (state.cur) {
+		audio_fifo_free(af, state.cur);
+		state.cur = NULL;
+	}
+}
+
+/**
+ * Switch to the format of \p afd. Only called with nothing queued or
+ * staged, since a source can't mix formats.
+ */
+static void openal_format(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int i;
+
+	alSourceStop(state.source);
+	alSourcei(state.source, AL_BUFFER, 0);
+
+	state.rate = afd->rate;
+	state.channels = afd->channels;
+	state.frames = af->period_frames ? af->period_frames : afd->rate * BUFFER_MS / 1000;
+	state.nbuffers = af->buffer_frames ? af->buffer_frames / state.frames : NUM_BUFFERS;
+	if (state.nbuffers < 2)
+		state.nbuffers = 2;
+	if (state.nbuffers > MAX_BUFFERS)
+		state.nbuffers = MAX_BUFFERS;
+
+	state.stage = realloc(state.stage, state.frames * afd->channels * sizeof(int16_t));
+
+	state.nfree = 0;
+	for (i = 0; i < state.nbuffers; ++i)
+		state.free[state.nfree++] = state.buffers[i];
+	state.qlen = 0;
+
+	audio_clock_rate(af, state.rate);
+
+	fprintf(stderr, "audio: %d Hz, %d channels, %d buffers of %d ms\n", state.rate,
+	        state.channels, state.nbuffers, state.frames * 1000 / state.rate);
 }
 
-static int queue_buffer(ALuint source, audio_fifo_t *af, ALuint buffer)
+/**
+ * Copy fifo chunks into the stage until it holds a full buffer, the next
+ * chunk is in another format, or the fifo has nothing more right now.
+ *
+ * @return Non-zero if the stage should be queued now
+ */
+static int openal_fill(audio_fifo_t *af)
 {
-    audio_fifo_data_t *afd = audio_get(af);
-    alBufferData(buffer, 
-		 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16, 
-		 afd->samples, 
-		 afd->nsamples * afd->channels * sizeof(short), 
-		 afd->rate);
-    alSourceQueueBuffers(source, 1, &buffer);
-	free(afd);
+	audio_fifo_data_t *afd;
+	int n;
+
+	while (state.staged < state.frames) {
+		if (!state.cur) {
+			afd = audio_tryget(af);
+			if (!afd)
+				return 0;
+
+			/* Flushed while filling, the chunk just taken is the new audio */
+			if (state.want_flush)
+				openal_flush(af);
+
+			state.cur = afd;
+			state.pos = 0;
+		}
+
+		if (state.cur->rate != state.rate || state.cur->channels != state.channels)
+			return state.staged > 0;
+
+		if (!state.pos)
+			audio_clock_anchor(af, state.cur, state.staged);
+
+		n = state.cur->nsamples - state.pos;
+		if (n > state.frames - state.staged)
+			n = state.frames - state.staged;
+
+		memcpy(state.stage + state.staged * state.channels,
+		       state.cur->samples + state.pos * state.channels,
+		       n * state.channels * sizeof(int16_t));
+
+		state.staged += n;
+		state.pos += n;
+
+		if (state.pos == state.cur->nsamples) {
+			audio_fifo_free(af, state.cur);
+			state.cur = NULL;
+		}
+	}
+
 	return 1;
 }
 
+/**
+ * Log wakeups and CPU time every ten seconds.
+ */
+static void openal_stats(void)
+{
+	int64_t now = audio_now_us();
+	int64_t t = now - state.stats_us;
+	double cpu;
+
+	if (t < 10000000)
+		return;
+
+	cpu = cpu_ms();
+	fprintf(stderr, "audio: %.1f wakeups/s for %.1f buffers/s, %.2f ms CPU per second\n",
+	        state.wakeups * 1000000.0 / t, state.submits * 1000000.0 / t,
+	        (cpu - state.stats_cpu) * 1000000.0 / t);
+
+	state.stats_us = now;
+	state.stats_cpu = cpu;
+	state.wakeups = 0;
+	state.submits = 0;
+}
+
+/**
+ * Fifo hooks, run on the driver thread from within audio_fifo_control()
+ * or audio_tryget().
+ */
+static void audio_pause(int pause)
+{
+	ALint playing;
+
+	if (pause) {
+		alSourcePause(state.source);
+		/* Stop the clock where the source stopped */
+		audio_clock_sync(state.af, openal_pending(), 0);
+	} else {
+		alGetSourcei(state.source, AL_SOURCE_STATE, &playing);
+		if (playing == AL_PAUSED)
+			alSourcePlay(state.source);
+	}
+}
+
+static void audio_flush(void)
+{
+	state.want_flush = 1;
+}
+
+/**
+ * The driver thread. Chunks are gathered into buffers of a fixed length
+ * and the thread sleeps until the oldest queued buffer should have played,
+ * or until the fifo has something for it.
+ */
 static void* audio_start(void *aux)
 {
 	audio_fifo_t *af = aux;
-    audio_fifo_data_t *afd;
-	unsigned int frame = 0;
-	ALCdevice *device = NULL;
-	ALCcontext *context = NULL;
-	ALuint buffers[NUM_BUFFERS];
-	ALuint source;
-	ALint processed;
+	audio_fifo_data_t *afd;
+	ALCcontext *context;
+	ALint playing;
 	ALenum error;
-	ALint rate;
-	ALint channels;
-	device = alcOpenDevice(NULL); /* Use the default device */
-	if (!device) error_exit("failed to open device");
-	context = alcCreateContext(device, NULL);
+	struct pollfd pfd;
+	ALint offset;
+	int paused, timeout, preroll, armed, left, r;
+
+	state.device = alcOpenDevice(af->device); /* NULL for the default device */
+	if (!state.device)
+		error_exit("failed to open device");
+	context = alcCreateContext(state.device, NULL);
 	alcMakeContextCurrent(context);
 	alListenerf(AL_GAIN, 1.0f);
 	alDistanceModel(AL_NONE);
-	alGenBuffers((ALsizei)NUM_BUFFERS, buffers);
-	alGenSources(1, &source);
-
-	/* First prebuffer some audio */
-	queue_buffer(source, af, buffers[0]);
-	queue_buffer(source, af, buffers[1]);
-	queue_buffer(source, af, buffers[2]);
-	for (;;) {
-      
-		alSourcePlay(source);
-		for (;;) {
-			/* Wait for some audio to play */
-			do {
-				alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed);
-				usleep(100);
-			} while (!processed);
-			
-			/* Remove old audio from the queue.. */
-			alSourceUnqueueBuffers(source, 1, &buffers[frame % 3]);
-			
-			/* and queue some more audio */
-			afd = audio_get(af);
-			alGetBufferi(buffers[frame % 3], AL_FREQUENCY, &rate);
-			alGetBufferi(buffers[frame % 3], AL_CHANNELS, &channels);
-			if (afd->rate != rate || afd->channels != channels) {
-				printf("rate or channel count changed, resetting\n");
-				break;
+	alGenBuffers(MAX_BUFFERS, state.buffers);
+	alGenSources(1, &state.source);
+
+	pfd.fd = af->efd;
+	pfd.events = POLLIN;
+
+	state.stats_us = audio_now_us();
+	state.stats_cpu = cpu_ms();
+
+	while (!af->shutdown) {
+		paused = audio_fifo_control(af);
+
+		if (state.want_flush)
+			openal_flush(af);
+
+		openal_reclaim();
+
+		if (!paused) {
+			if (!state.cur && (afd = audio_tryget(af))) {
+				if (state.want_flush)
+					openal_flush(af);
+
+				state.cur = afd;
+				state.pos = 0;
 			}
-			alBufferData(buffers[frame % 3], 
-						 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16, 
-						 afd->samples, 
-						 afd->nsamples * afd->channels * sizeof(short), 
-						 afd->rate);
-
-			alSourceQueueBuffers(source, 1, &buffers[frame % 3]);
-			
-			if ((error = alcGetError(device)) != AL_NO_ERROR) {
-				printf("openal al error: %d\n", error);
-				exit(1);
+
+			/* A new format once the old one has played out */
+			if (state.cur && !state.staged && !state.qlen &&
+			    (state.cur->rate != state.rate || state.cur->channels != state.channels))
+				openal_format(af, state.cur);
+
+			while (state.nfree && openal_fill(af))
+				openal_submit(af);
+
+			/* Better a short buffer now than a source that runs dry */
+			if (state.staged && state.nfree && !state.qlen)
+				openal_submit(af);
+
+			alGetSourcei(state.source, AL_SOURCE_STATE, &playing);
+			if (state.qlen && playing != AL_PLAYING)
+				alSourcePlay(state.source);
+
+			audio_clock_sync(af, openal_pending(), state.qlen > 0);
+		}
+
+		if ((error = alcGetError(state.device)) != AL_NO_ERROR) {
+			printf("openal al error: %d\n", error);
+			exit(1);
+		}
+
+		openal_stats();
+
+		/* Until the oldest buffer should be done... */
+		timeout = -1;
+		if (!paused && state.qlen) {
+			alGetSourcei(state.source, AL_SAMPLE_OFFSET, &offset);
+			left = state.queued[state.qhead] - offset;
+			timeout = (int)((int64_t)(left > 0 ? left : 0) * 1000 / state.rate) + 1;
+		}
+
+		/* ...or until the fifo has more, if we are not holding a chunk already */
+		armed = paused || !state.cur;
+		preroll = -1;
+		if (armed) {
+			preroll = audio_fifo_arm(af);
+			if (!preroll) {
+				audio_fifo_disarm(af, 0);
+				continue;
 			}
-			frame++;
+			if (preroll > 0 && (timeout < 0 || preroll < timeout))
+				timeout = preroll;
 		}
-		/* Format or rate changed, so we need to reset all buffers */
-		alSourcei(source, AL_BUFFER, 0);
-		alSourceStop(source);
-
-		/* Make sure we don't lose the audio packet that caused the change */
-		alBufferData(buffers[0], 
-					 afd->channels == 1 ? AL_FORMAT_MONO16 : AL_FORMAT_STEREO16, 
-					 afd->samples, 
-					 afd->nsamples * afd->channels * sizeof(short), 
-					 afd->rate);
-
-		alSourceQueueBuffers(source, 1, &buffers[0]);
-		queue_buffer(source, af, buffers[1]);
-		queue_buffer(source, af, buffers[2]);
-		frame = 0;
-	}
-}
 
-void audio_init(audio_fifo_t *af)
-{
-    pthread_t tid;
+		if (af->efd < 0 && (timeout < 0 || timeout > FALLBACK_POLL_MS))
+			timeout = FALLBACK_POLL_MS;
+
+		r = poll(&pfd, 1, timeout);
+		state.wakeups++;
 
-    TAILQ_INIT(&af->q);
-    af->qlen = 0;
+		if (armed || (r > 0 && (pfd.revents & POLLIN)))
+			audio_fifo_disarm(af, r == 0 && timeout == preroll);
+	}
 
-    pthread_mutex_init(&af->mutex, NULL);
-    pthread_cond_init(&af->cond, NULL);
+	alSourceStop(state.source);
+	alcMakeContextCurrent(NULL);
+	alcDestroyContext(context);
+	alcCloseDevice(state.device);
 
-    pthread_create(&tid, NULL, audio_start, af);
+	af->shutdown = 2;
+	return NULL;
 }
 
-void audio_fifo_flush(audio_fifo_t *af)
-{
-    audio_fifo_data_t *afd;
+/// The device options this driver reads
+const char audio_driver_options[] = "DPb";
 
-    pthread_mutex_lock(&af->mutex);
+void audio_init(audio_fifo_t *af)
+{
+	pthread_t tid;
 
-    while((afd = TAILQ_FIRST(&af->q))) {
-	TAILQ_REMOVE(&af->q, afd, link);
-	free(afd);
-    }
+	audio_fifo_init(af);
+	af->on_pause = audio_pause;
+	af->on_flush = audio_flush;
+	state.af = af;
+	audio_fifo_eventfd(af);
 
-    af->qlen = 0;
-    pthread_mutex_unlock(&af->mutex);
+	pthread_create(&tid, NULL, audio_start, af);
 }
-
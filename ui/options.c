@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Command line options for the audio pipeline, see options.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsp.h"
+#include "options.h"
+#include "resample.h"
+
+/**
+ * Every audio option, the common ones first. Those in the second half only
+ * exist if the driver lists them in audio_driver_options.
+ */
+static const struct audio_opt {
+	char opt;
+	int common;
+	const char *arg;	/* Argument in the synopsis, NULL for a flag */
+	const char *help;
+} opts[] = {
+	{ 'g', 1, NULL, "gapless playback, the next track is loaded before the current one ends" },
+	{ 'j', 1, "<min_ms>:<max_ms>", "adapt the audio buffer between min_ms and max_ms, pre-rolling min_ms" },
+	{ 'x', 1, "<seconds>", "crossfade consecutive tracks over 0-12 seconds, implies -g" },
+	{ 'v', 1, "<percent>", "output volume in percent" },
+	{ 'r', 1, "<dB>", "ReplayGain adjustment in dB" },
+	{ 'B', 1, NULL, "benchmark the sample processing kernels and exit" },
+	{ 'R', 0, "<rate>", "open the device once at this rate and resample to it" },
+	{ 'Q', 0, "fast|medium|best", "resampler quality" },
+	{ 'D', 0, "<device>", "output device, overrides a calibrated one (\"null\" discards the audio)" },
+	{ 'P', 0, "<frames>", "device period size in frames" },
+	{ 'b', 0, "<frames>", "device buffer size in frames" },
+	{ 'C', 0, NULL, "calibrate the device latency before playing and save the result" },
+	{ 'X', 0, "<xruns>", "xruns within 30 seconds that double the device buffer, -1 to never grow it" },
+	{ 'N', 0, NULL, "never block in device writes" },
+	{ 'T', 0, NULL, "timer scheduling: a large device buffer topped up on a timer, for fewer wakeups" },
+	{ 'J', 0, "<ms>", "wake up to this many ms late to simulate scheduling jitter" },
+};
+
+#define NUM_OPTS (int)(sizeof(opts) / sizeof(opts[0]))
+
+/**
+ * Whether option \p i applies with the driver linked in
+ */
+static int have_opt(int i)
+{
+	return opts[i].common || strchr(audio_driver_options, opts[i].opt) != NULL;
+}
+
+/**
+ * The getopt() option string: the front-end's own options followed by
+ * the audio ones the driver takes.
+ *
+ * @param  own  The front-end's options, in getopt() syntax
+ * @return A static buffer
+ */
+const char *audio_optstring(const char *own)
+{
+	static char buf[128];
+	size_t n;
+	int i;
+
+	n = strlen(own);
+	if (n > sizeof(buf) - 2 * NUM_OPTS - 1)
+		n = sizeof(buf) - 2 * NUM_OPTS - 1;
+	memcpy(buf, own, n);
+
+	for (i = 0; i < NUM_OPTS; i++) {
+		if (!have_opt(i))
+			continue;
+		buf[n++] = opts[i].opt;
+		if (opts[i].arg)
+			buf[n++] = ':';
+	}
+	buf[n] = '\0';
+	return buf;
+}
+
+/**
+ * Apply one option returned by getopt(). -B runs the benchmarks and exits.
+ *
+ * @param  af   The fifo whose knobs the option sets, before audio_init()
+ * @param  ao   Settings the front-end applies itself
+ * @param  opt  The option character
+ * @param  arg  Its argument, or NULL
+ * @return 1 if handled, 0 if \p opt is not an audio option for this
+ *         driver, -1 if its argument is invalid
+ */
+int audio_option(audio_fifo_t *af, audio_options_t *ao, int opt, const char *arg)
+{
+	int i;
+
+	for (i = 0; i < NUM_OPTS; i++)
+		if (opts[i].opt == opt)
+			break;
+	if (i == NUM_OPTS || !have_opt(i))
+		return 0;
+
+	switch (opt) {
+	case 'g':
+		ao->gapless = 1;
+		break;
+
+	case 'j':
+		af->jitter = 1;
+		sscanf(arg, "%d:%d", &af->min_ms, &af->max_ms);
+		break;
+
+	case 'x':
+		/* Crossfading needs the next track loaded as the current one ends */
+		af->xfade_ms = atoi(arg) * 1000;
+		ao->gapless = 1;
+		break;
+
+	case 'v':
+		ao->volume = atoi(arg);
+		break;
+
+	case 'r':
+		ao->replaygain = atof(arg);
+		break;
+
+	case 'B':
+		dsp_init();
+		dsp_benchmark();
+		resampler_benchmark();
+		exit(0);
+
+	case 'R':
+		af->out_rate = atoi(arg);
+		break;
+
+	case 'Q':
+		af->quality = resampler_preset(arg);
+		if (af->quality < 0)
+			return -1;
+		break;
+
+	case 'D':
+		af->device = arg;
+		break;
+
+	case 'P':
+		af->period_frames = atoi(arg);
+		break;
+
+	case 'b':
+		af->buffer_frames = atoi(arg);
+		break;
+
+	case 'C':
+		af->calibrate = 1;
+		break;
+
+	case 'X':
+		af->xrun_limit = atoi(arg);
+		break;
+
+	case 'N':
+		af->nonblock = 1;
+		break;
+
+	case 'T':
+		af->tsched = 1;
+		break;
+
+	case 'J':
+		af->sim_jitter_ms = atoi(arg);
+		break;
+	}
+	return 1;
+}
+
+/**
+ * Print the audio options to a usage line, each with a leading space
+ */
+void audio_synopsis(FILE *fp)
+{
+	int i;
+
+	for (i = 0; i < NUM_OPTS; i++) {
+		if (!have_opt(i))
+			continue;
+		if (opts[i].arg)
+			fprintf(fp, " [-%c %s]", opts[i].opt, opts[i].arg);
+		else
+			fprintf(fp, " [-%c]", opts[i].opt);
+	}
+}
+
+/**
+ * Print one help line per audio option
+ */
+void audio_help(FILE *fp)
+{
+	int i;
+
+	for (i = 0; i < NUM_OPTS; i++)
+		if (have_opt(i))
+			fprintf(fp, "  -%c  %s\n", opts[i].opt, opts[i].help);
+}
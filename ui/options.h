@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Command line options for the audio pipeline, shared by the front-ends.
+ *
+ * Each front-end keeps its own options (login, playlist, ...) and hands
+ * everything else to audio_option(). Which device options exist depends
+ * on the output driver linked in, see audio_driver_options in audio.h,
+ * so the option string and the usage text are built from that list.
+ */
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include <stdio.h>
+
+#include "audio.h"
+
+/* --- Types --- */
+typedef struct audio_options {
+	int gapless;		///< Keep the player loaded across tracks
+	int volume;		///< Output volume in percent
+	double replaygain;	///< ReplayGain adjustment in dB
+} audio_options_t;
+
+/* --- Functions --- */
+extern const char *audio_optstring(const char *own);
+extern int audio_option(audio_fifo_t *af, audio_options_t *ao, int opt, const char *arg);
+extern void audio_synopsis(FILE *fp);
+extern void audio_help(FILE *fp);
+
+#endif /* _OPTIONS_H_ */
@@ -47,17 +47,25 @@ static void audio_callback (void *aux, AudioQueueRef aq, AudioQueueBufferRef buf
     memcpy(bufout->mAudioData, afd->samples, bufout->mAudioDataByteSize);
 
     AudioQueueEnqueueBuffer(state.queue, bufout, 0, NULL);
-    free(afd);
+    audio_fifo_free(af, afd);
 }
 
+static void audio_pause(int pause)
+{
+    if (pause)
+	AudioQueuePause(state.queue);
+    else
+	AudioQueueStart(state.queue, NULL);
+}
+
+/// The device options this driver reads
+const char audio_driver_options[] = "";
+
 void audio_init(audio_fifo_t *af)
 {
     int i;
-    TAILQ_INIT(&af->q);
-    af->qlen = 0;
-
-    pthread_mutex_init(&af->mutex, NULL);
-    pthread_cond_init(&af->cond, NULL);
+    audio_fifo_init(af);
+    af->on_pause = audio_pause;
 
     bzero(&state, sizeof(state));
 
@@ -86,18 +94,3 @@ void audio_init(audio_fifo_t *af)
     }
     if (noErr != AudioQueueStart(state.queue, NULL)) puts("AudioQueueStart failed");
 }
-
-void audio_fifo_flush(audio_fifo_t *af)
-{
-    audio_fifo_data_t *afd;
-
-    pthread_mutex_lock(&af->mutex);
-
-    while((afd = TAILQ_FIRST(&af->q))) {
-	TAILQ_REMOVE(&af->q, afd, link);
-	free(afd);
-    }
-
-    af->qlen = 0;
-    pthread_mutex_unlock(&af->mutex);
-}
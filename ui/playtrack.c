@@ -27,17 +27,17 @@
 
 #include <errno.h>
 #include <libgen.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 
 #include <libspotify/api.h>
 
 #include "audio.h"
+#include "evloop.h"
+#include "process.h"
 
 
 /* --- Data --- */
@@ -49,14 +49,10 @@ extern const size_t g_appkey_size;
 
 /// The output queue for audo data
 static audio_fifo_t g_audiofifo;
-/// Synchronization mutex for the main thread
-static pthread_mutex_t g_notify_mutex;
-/// Synchronization condition variable for the main thread
-static pthread_cond_t g_notify_cond;
-/// Synchronization variable telling the main thread to process events
-static int g_notify_do;
-/// Non-zero when a track has ended and the jukebox has not yet started a new one
-static int g_playback_done;
+/// The main loop, woken by the session callbacks
+static evloop_t g_loop;
+/// Time budget and histogram for session event processing
+static process_budget_t g_process = { .budget_ms = PROCESS_BUDGET_MS };
 /// The global session handle
 static sp_session *g_sess;
 /// Handle to the curren track
@@ -118,16 +114,14 @@ static void metadata_updated(sp_session *sess)
  * This callback is called from an internal libspotify thread to ask
  * us to reiterate the main loop.
  *
- * We notify the main thread using a condition variable and a protected variable.
+ * We post NOTIFY_EVENTS to the main loop, without taking a lock. A burst of
+ * these before the loop gets to run wakes it once.
  *
  * @sa sp_session_callbacks#notify_main_thread
  */
 static void notify_main_thread(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_notify_do = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	evloop_notify(&g_loop, NOTIFY_EVENTS);
 }
 
 /**
@@ -138,39 +132,11 @@ static void notify_main_thread(sp_session *sess)
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
-	audio_fifo_t *af = &g_audiofifo;
-	audio_fifo_data_t *afd;
-	size_t s;
-
 	if (num_frames == 0)
 		return 0; // Audio discontinuity, do nothing
 
-	pthread_mutex_lock(&af->mutex);
-
-	/* Buffer one second of audio */
-	if (af->qlen > format->sample_rate) {
-		pthread_mutex_unlock(&af->mutex);
-
-		return 0;
-	}
-
-	s = num_frames * sizeof(int16_t) * format->channels;
-
-	afd = malloc(sizeof(audio_fifo_data_t) + s);
-	memcpy(afd->samples, frames, s);
-
-	afd->nsamples = num_frames;
-
-	afd->rate = format->sample_rate;
-	afd->channels = format->channels;
-
-	TAILQ_INSERT_TAIL(&af->q, afd, link);
-	af->qlen += num_frames;
-
-	pthread_cond_signal(&af->cond);
-	pthread_mutex_unlock(&af->mutex);
-
-	return num_frames;
+	return audio_fifo_put(&g_audiofifo, frames, num_frames,
+	                      format->channels, format->sample_rate);
 }
 
 
@@ -181,10 +147,7 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
  */
 static void end_of_track(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_playback_done = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	evloop_notify(&g_loop, NOTIFY_END_OF_TRACK);
 }
 
 /**
@@ -241,7 +204,8 @@ static sp_session_config spconfig = {
 /**
  * A track has ended. Remove it from the playlist.
  *
- * Called from the main loop when the music_delivery() callback has set g_playback_done.
+ * Called from the main loop when the end_of_track() callback has posted
+ * NOTIFY_END_OF_TRACK.
  */
 static void track_ended(void)
 {
@@ -253,6 +217,23 @@ static void track_ended(void)
 	}
 }
 
+/**
+ * Signals, taken on the main loop through a signalfd. SIGINT and SIGTERM
+ * let the driver close the device before we exit, SIGUSR1 logs how often
+ * the loop wakes up and how long event processing takes.
+ */
+static void on_signal(evloop_t *el, int signo, void *aux)
+{
+	if (signo == SIGUSR1) {
+		evloop_stats(el);
+		process_stats(&g_process);
+		return;
+	}
+
+	audio_fifo_shutdown(&g_audiofifo);
+	exit(0);
+}
+
 /**
  * Show usage information
  *
@@ -268,6 +249,7 @@ int main(int argc, char **argv)
 	sp_session *sp;
 	sp_error err;
 	int next_timeout = 0;
+	sigset_t sigs;
 	const char *username = NULL;
 	const char *password = NULL;
 	int opt;
@@ -290,6 +272,16 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	/* Before any thread starts, so they all leave these signals to us */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	if (evloop_init(&g_loop) < 0 || evloop_signals(&g_loop, &sigs, on_signal, NULL) < 0) {
+		perror("evloop");
+		exit(1);
+	}
+
 	audio_init(&g_audiofifo);
 
 	/* Create session */
@@ -305,45 +297,20 @@ int main(int argc, char **argv)
 
 	g_sess = sp;
 
-	pthread_mutex_init(&g_notify_mutex, NULL);
-	pthread_cond_init(&g_notify_cond, NULL);
-
 	sp_session_login(sp, username, password);
-	pthread_mutex_lock(&g_notify_mutex);
 
 	for (;;) {
-		if (next_timeout == 0) {
-			while(!g_notify_do && !g_playback_done)
-				pthread_cond_wait(&g_notify_cond, &g_notify_mutex);
-		} else {
-			struct timespec ts;
-
-#if _POSIX_TIMERS > 0
-			clock_gettime(CLOCK_REALTIME, &ts);
-#else
-			struct timeval tv;
-			gettimeofday(&tv, NULL);
-			TIMEVAL_TO_TIMESPEC(&tv, &ts);
-#endif
-			ts.tv_sec += next_timeout / 1000;
-			ts.tv_nsec += (next_timeout % 1000) * 1000000;
-
-			pthread_cond_timedwait(&g_notify_cond, &g_notify_mutex, &ts);
+		if (evloop_wait(&g_loop) < 0) {
+			perror("epoll_wait");
+			exit(1);
 		}
 
-		g_notify_do = 0;
-		pthread_mutex_unlock(&g_notify_mutex);
-
-		if (g_playback_done) {
+		if (g_loop.posted & NOTIFY_END_OF_TRACK)
 			track_ended();
-			g_playback_done = 0;
-		}
-
-		do {
-			sp_session_process_events(sp, &next_timeout);
-		} while (next_timeout == 0);
 
-		pthread_mutex_lock(&g_notify_mutex);
+		/* Out of budget, the timer fires at once after a look at the rest */
+		next_timeout = process_events(&g_process, sp);
+		evloop_timeout(&g_loop, next_timeout);
 	}
 
 	return 0;
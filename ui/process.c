@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Budgeted session event processing, see process.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "process.h"
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Process session events until libspotify has nothing more to do right
+ * now, or the budget is spent. Call from the main loop only.
+ *
+ * @return The session's next_timeout, or 0 when the budget ran out with
+ *         work left, in which case the loop should come back as soon as
+ *         it has seen to everything else
+ */
+int process_events(process_budget_t *pb, sp_session *sess)
+{
+	int64_t start = now_ns(), limit = pb->budget_ms * 1000000LL, t;
+	int next_timeout, b;
+
+	do {
+		sp_session_process_events(sess, &next_timeout);
+		t = now_ns() - start;
+	} while (next_timeout == 0 && (!limit || t < limit));
+
+	pb->turns++;
+	if (next_timeout == 0)
+		pb->cut++;
+
+	pb->total_ns += t;
+	if (t > pb->max_ns)
+		pb->max_ns = t;
+
+	for (b = 0; b < PROCESS_BUCKETS - 1 && t >= (1000000LL << b); ++b)
+		;
+	pb->hist[b]++;
+
+	return next_timeout;
+}
+
+/**
+ * Log how long the turns took since the last call, and start over.
+ */
+void process_stats(process_budget_t *pb)
+{
+	char buf[256];
+	int b, len = 0;
+
+	if (!pb->turns)
+		return;
+
+	for (b = 0; b < PROCESS_BUCKETS; ++b) {
+		if (!pb->hist[b])
+			continue;
+
+		if (b == 0)
+			len += snprintf(buf + len, sizeof(buf) - len, " <1:%u", pb->hist[b]);
+		else if (b == PROCESS_BUCKETS - 1)
+			len += snprintf(buf + len, sizeof(buf) - len, " %d+:%u", 1 << (b - 1), pb->hist[b]);
+		else
+			len += snprintf(buf + len, sizeof(buf) - len, " %d-%d:%u",
+			                1 << (b - 1), 1 << b, pb->hist[b]);
+	}
+
+	fprintf(stderr, "process: %u turns, %u cut short at %d ms, %.2f ms on average, %.2f ms at worst\n",
+	        pb->turns, pb->cut, pb->budget_ms, pb->total_ns / 1e6 / pb->turns, pb->max_ns / 1e6);
+	fprintf(stderr, "process: turns by ms:%s\n", buf);
+
+	pb->turns = 0;
+	pb->cut = 0;
+	memset(pb->hist, 0, sizeof(pb->hist));
+	pb->total_ns = 0;
+	pb->max_ns = 0;
+}
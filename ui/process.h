@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Time-budgeted sp_session_process_events() for the main loops.
+ *
+ * libspotify asks to be called again at once for as long as it has work,
+ * which during login and rootlist sync can go on for a long time. Here the
+ * loop gives up after the budget, so track changes and UI work get a turn
+ * in between, and the time each turn took is kept in a histogram.
+ */
+#ifndef _PROCESS_H_
+#define _PROCESS_H_
+
+#include <stdint.h>
+#include <libspotify/api.h>
+
+/// Budget per turn, unless the front-end's -E says otherwise
+#define PROCESS_BUDGET_MS 10
+/// Histogram buckets: under 1 ms, then 1-2, 2-4, ... and 512 ms or more
+#define PROCESS_BUCKETS 11
+
+/* --- Types --- */
+typedef struct process_budget {
+	int budget_ms;			///< Most time one turn may take, 0 for no limit
+	unsigned turns;			///< process_events() calls since process_stats()
+	unsigned cut;			///< Of those, ones the budget ended with work left
+	unsigned hist[PROCESS_BUCKETS];	///< Turns by time taken
+	int64_t total_ns;
+	int64_t max_ns;
+} process_budget_t;
+
+/* --- Functions --- */
+extern int process_events(process_budget_t *pb, sp_session *sess);
+extern void process_stats(process_budget_t *pb);
+
+#endif /* _PROCESS_H_ */
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Polyphase FIR sample rate converter.
+ *
+ * The rate ratio is reduced to up/down. Conceptually the input is
+ * zero-stuffed by up, lowpass filtered and decimated by down; only the
+ * filter phase that lands on each output frame is ever evaluated, so
+ * every output frame costs one taps-long dot product in dsp_fir2().
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+#include "resample.h"
+
+/// Largest filter bank we build, in phases
+#define MAX_PHASES 4096
+/// Most taps per phase any preset uses
+#define MAX_TAPS 32
+
+static const struct preset {
+	const char *name;
+	int taps;
+	double cutoff;	/* Passband edge as a fraction of the lower Nyquist rate */
+} presets[] = {
+	[RESAMPLE_FAST]    = { "fast",    8, 0.80 },
+	[RESAMPLE_MEDIUM]  = { "medium", 16, 0.90 },
+	[RESAMPLE_BEST]    = { "best",   32, 0.95 },
+};
+
+/**
+ * Index into presets[] for \p quality. RESAMPLE_DEFAULT is medium.
+ */
+static int preset_index(int quality)
+{
+	if (quality <= RESAMPLE_DEFAULT || quality > RESAMPLE_BEST)
+		return RESAMPLE_MEDIUM;
+
+	return quality;
+}
+
+static int gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/**
+ * Windowed sinc lowpass, split into up phases of taps coefficients each.
+ * Every phase is normalised to unity DC gain so the output has no ripple
+ * at the phase rate.
+ */
+static void design(resampler_t *rs, double cutoff)
+{
+	const int len = rs->up * rs->taps;
+	const double ratio = rs->up < rs->down ? (double)rs->up / rs->down : 1.0;
+	const double fc = cutoff * 0.5 * ratio / rs->up;
+	double *h = malloc(len * sizeof(double));
+	double t, w, sum;
+	int16_t *c;
+	int i, k, p, v, total;
+
+	for (i = 0; i < len; ++i) {
+		t = i - (len - 1) / 2.0;
+		w = (i + 0.5) / len;
+		w = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+		h[i] = w * (t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t));
+	}
+
+	for (p = 0; p < rs->up; ++p) {
+		c = rs->coef + p * rs->taps * 2;
+
+		for (sum = 0, k = 0; k < rs->taps; ++k)
+			sum += h[k * rs->up + p];
+
+		/* Newest input frame is last in memory, so reverse the taps */
+		for (total = 0, k = 0; k < rs->taps; ++k) {
+			v = lrint(h[k * rs->up + p] * DSP_FIR_UNITY / sum);
+			v = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+			c[(rs->taps - 1 - k) * 2] = c[(rs->taps - 1 - k) * 2 + 1] = v;
+			total += v;
+		}
+
+		c[rs->taps] += DSP_FIR_UNITY - total;
+		c[rs->taps + 1] += DSP_FIR_UNITY - total;
+	}
+
+	free(h);
+}
+
+/**
+ * Set up a converter from \p in_rate to \p out_rate. \p rs must be zeroed
+ * or have been initialised before; its buffers are reused.
+ *
+ * @return 0 on success, -1 if the ratio needs too large a filter bank
+ */
+int resampler_init(resampler_t *rs, int in_rate, int out_rate, int quality)
+{
+	const struct preset *p;
+	int g = gcd(in_rate, out_rate);
+
+	if (quality < RESAMPLE_DEFAULT || quality > RESAMPLE_BEST)
+		quality = RESAMPLE_DEFAULT;
+
+	p = &presets[preset_index(quality)];
+
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->quality = quality;
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+
+	/* Equal rates only need the upmix */
+	rs->taps = rs->up == rs->down ? 0 : p->taps;
+
+	if (rs->up > MAX_PHASES || (rs->taps && rs->down > rs->up * rs->taps)) {
+		rs->in_rate = 0;
+		return -1;
+	}
+
+	if (rs->taps) {
+		rs->coef = realloc(rs->coef, rs->up * rs->taps * 2 * sizeof(int16_t));
+		design(rs, p->cutoff);
+	}
+
+	resampler_reset(rs);
+	return 0;
+}
+
+/**
+ * Forget buffered input, as after a seek. The next output frame starts
+ * from silence.
+ */
+void resampler_reset(resampler_t *rs)
+{
+	rs->len = rs->taps ? rs->taps - 1 : 0;
+	rs->phase = 0;
+
+	if (rs->len > rs->cap) {
+		rs->cap = rs->len;
+		rs->buf = realloc(rs->buf, rs->cap * 2 * sizeof(int16_t));
+	}
+
+	if (rs->len)
+		memset(rs->buf, 0, rs->len * 2 * sizeof(int16_t));
+}
+
+/**
+ * Flush the input still held for the filter, as at the end of a track, and
+ * reset. \p out must have room for resampler_max_out() of rs->taps frames.
+ *
+ * @return Frames written to \p out
+ */
+int resampler_drain(resampler_t *rs, int16_t *out)
+{
+	static const int16_t silence[MAX_TAPS / 2 * 2];
+	int n;
+
+	if (!rs->taps)
+		return 0;
+
+	n = resampler_process(rs, silence, rs->taps / 2, 2, out);
+	resampler_reset(rs);
+	return n;
+}
+
+void resampler_free(resampler_t *rs)
+{
+	free(rs->coef);
+	free(rs->buf);
+	memset(rs, 0, sizeof(*rs));
+}
+
+/**
+ * Upper bound on the output of resampler_process() for \p frames frames
+ * of input
+ */
+int resampler_max_out(const resampler_t *rs, int frames)
+{
+	if (!rs->taps)
+		return frames;
+
+	return (int)((int64_t)(rs->len + frames) * rs->up / rs->down) + 1;
+}
+
+/**
+ * Convert \p frames frames of \p channels channel audio. The output is
+ * stereo and \p out must have room for resampler_max_out() frames. Input
+ * the filter can't use yet is kept for the next call.
+ *
+ * @return Frames written to \p out
+ */
+int resampler_process(resampler_t *rs, const int16_t *in, int frames,
+                      int channels, int16_t *out)
+{
+	int16_t *x;
+	int i, n = 0, pos = 0;
+
+	if (!rs->taps) {
+		x = out;
+	} else {
+		if (rs->len + frames > rs->cap) {
+			rs->cap = rs->len + frames;
+			rs->buf = realloc(rs->buf, rs->cap * 2 * sizeof(int16_t));
+		}
+
+		x = rs->buf + rs->len * 2;
+	}
+
+	if (channels == 2) {
+		memcpy(x, in, frames * 2 * sizeof(int16_t));
+	} else {
+		for (i = 0; i < frames; ++i, in += channels) {
+			x[i * 2] = in[0];
+			x[i * 2 + 1] = in[channels > 1];
+		}
+	}
+
+	if (!rs->taps)
+		return frames;
+
+	rs->len += frames;
+
+	while (pos + rs->taps <= rs->len) {
+		dsp_fir2(out + n * 2, rs->buf + pos * 2,
+		         rs->coef + rs->phase * rs->taps * 2, rs->taps);
+		++n;
+
+		rs->phase += rs->down;
+		pos += rs->phase / rs->up;
+		rs->phase %= rs->up;
+	}
+
+	rs->len -= pos;
+	memmove(rs->buf, rs->buf + pos * 2, rs->len * 2 * sizeof(int16_t));
+
+	return n;
+}
+
+/**
+ * Look up a quality preset by name
+ *
+ * @return The RESAMPLE_* preset, or -1 if there is none by that name
+ */
+int resampler_preset(const char *name)
+{
+	int i;
+
+	for (i = RESAMPLE_FAST; i <= RESAMPLE_BEST; ++i)
+		if (!strcmp(name, presets[i].name))
+			return i;
+
+	return -1;
+}
+
+const char *resampler_preset_name(int quality)
+{
+	return presets[preset_index(quality)].name;
+}
+
+
+/* ------------------------------  BENCHMARK  ------------------------------ */
+#define BENCH_SECONDS 20
+#define BENCH_CHUNK 2048
+
+/**
+ * Convert 44.1 kHz to 48 kHz with every preset and print the CPU time each
+ * needs per second of audio.
+ */
+void resampler_benchmark(void)
+{
+	static int16_t in[BENCH_CHUNK * 2];
+	resampler_t rs;
+	struct timespec t0, t1;
+	int16_t *out;
+	double ms;
+	int i, q, n;
+
+	for (i = 0; i < BENCH_CHUNK * 2; ++i)
+		in[i] = 16000 * sin(i * 0.01);
+
+	for (q = RESAMPLE_FAST; q <= RESAMPLE_BEST; ++q) {
+		memset(&rs, 0, sizeof(rs));
+		resampler_init(&rs, 44100, 48000, q);
+		out = malloc(resampler_max_out(&rs, BENCH_CHUNK) * 2 * sizeof(int16_t));
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (n = 0; n < 44100 * BENCH_SECONDS; n += BENCH_CHUNK)
+			resampler_process(&rs, in, BENCH_CHUNK, 2, out);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+		printf("resample: %-6s 44100 -> 48000 Hz, %.3f ms CPU per second of audio (%s)\n",
+		       presets[q].name, ms / BENCH_SECONDS, dsp_name);
+
+		free(out);
+		resampler_free(&rs);
+	}
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2010 Spotify Ltd
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ *
+ * Polyphase FIR sample rate converter with mono to stereo upmix.
+ *
+ * Output is always interleaved stereo. The filter runs on dsp_fir2(), so
+ * dsp_init() must have been called first.
+ */
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+/* --- Types --- */
+/// Quality presets, 0 picks the default
+enum {
+	RESAMPLE_DEFAULT,
+	RESAMPLE_FAST,		///< 8 taps per phase
+	RESAMPLE_MEDIUM,	///< 16 taps per phase
+	RESAMPLE_BEST,		///< 32 taps per phase
+};
+
+typedef struct resampler {
+	int in_rate;
+	int out_rate;
+	int quality;
+	int up;			///< Interpolation factor, out_rate / gcd
+	int down;		///< Decimation factor, in_rate / gcd
+	int taps;		///< Filter taps per phase
+	int16_t *coef;		///< up phases of taps coefficient pairs
+	int16_t *buf;		///< Pending stereo input, history included
+	int len;		///< Frames in buf
+	int cap;		///< Frames buf has room for
+	int phase;		///< Filter phase of the next output frame
+} resampler_t;
+
+/* --- Functions --- */
+extern int resampler_init(resampler_t *rs, int in_rate, int out_rate, int quality);
+extern void resampler_reset(resampler_t *rs);
+extern int resampler_drain(resampler_t *rs, int16_t *out);
+extern void resampler_free(resampler_t *rs);
+extern int resampler_max_out(const resampler_t *rs, int frames);
+extern int resampler_process(resampler_t *rs, const int16_t *in, int frames,
+                             int channels, int16_t *out);
+extern int resampler_preset(const char *name);
+extern const char *resampler_preset_name(int quality);
+extern void resampler_benchmark(void);
+
+#endif /* _RESAMPLE_H_ */
@@ -21,25 +21,27 @@
  *
  *
  * This example application shows parts of the playlist and player submodules.
- * It also shows another way of doing synchronization between callbacks and
- * the main thread.
+ * It also shows how to drive libspotify from the GLib main loop, so that the
+ * session callbacks and the GTK widgets they update share one thread.
  *
  * This file is part of the libspotify examples suite.
  */
 
 #include <errno.h>
 #include <libgen.h>
-#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <gtk/gtk.h>
 
 #include <libspotify/api.h>
 #include "audio.h"
+#include "marshal.h"
+#include "notify.h"
+#include "options.h"
+#include "process.h"
 
 /* --- Data --- */
 /// The application key is specific to each project, and allows Spotify
@@ -50,14 +52,20 @@ extern const size_t g_appkey_size;
 
 /// The output queue for audo data
 static audio_fifo_t g_audiofifo;
-/// Synchronization mutex for the main thread
-static pthread_mutex_t g_notify_mutex;
-/// Synchronization condition variable for the main thread
-static pthread_cond_t g_notify_cond;
-/// Synchronization variable telling the main thread to process events
-static int g_notify_do;
-/// Non-zero when a track has ended and the jukebox has not yet started a new one
-static int g_playback_done;
+/// Events libspotify's threads post for the main loop, see spotify_source_funcs
+static notify_t g_notify;
+/// Time budget and histogram for session event processing
+static process_budget_t g_process = { .budget_ms = PROCESS_BUDGET_MS };
+/// Model updates for ui_drain() to apply, see ui_post()
+static marshal_t g_marshal;
+/// Non-zero while a ui_drain() is scheduled
+static volatile int g_drain_scheduled;
+/// When ui_drain() last ran, in us of g_get_monotonic_time()
+static gint64 g_drain_us;
+/// Playlist rows by sp_playlist, each a GtkTreeIter (the store's persist)
+static GHashTable *g_playlist_rows;
+/// Model changes made and batches run since the last ui_stats()
+static unsigned g_ui_changes, g_ui_batches;
 /// The global session handle
 static sp_session *g_sess;
 /// Handle to the playlist currently being played
@@ -70,9 +78,22 @@ static int g_remove_tracks = 0;
 static sp_track *g_currenttrack;
 /// Index to the next track
 static int g_track_index;
+/// Gapless playback, volume and ReplayGain from the command line
+static audio_options_t g_audioopts = { .volume = 100 };
+/// Non-zero while the user has paused playback
+static int g_paused;
+
+/// Transport commands, see transport_run()
+enum {
+	TRANSPORT_NONE,
+	TRANSPORT_PAUSE,
+	TRANSPORT_RESUME,
+	TRANSPORT_SKIP,
+	TRANSPORT_SEEK,		///< Relative, by the argument in ms
+	TRANSPORT_QUIT,
+};
 
 /// GTK stuff
-pthread_t thread;
 GtkWidget           *win_Main;
 GtkWidget           *scl_List;
 GtkWidget           *tbl_Main;
@@ -84,14 +105,25 @@ GtkCellRenderer     *renderer = NULL;
 GtkTreeStore *model;
 GtkWidget *treeTracks = NULL;
 GtkWidget           *btn_key_Add;
+GtkWidget           *scl_Volume;
+GtkWidget           *box_Transport;
+GtkWidget           *lbl_Position;
 GtkTreeViewColumn   *col;
 
-sp_playlist* playlists[100];
-int num_playlists;
+/// Least time between two ui_drain() batches, for at most 30 per second
+#define UI_DRAIN_INTERVAL_MS 33
+
+/// Model updates, see ui_post()
+enum {
+	UI_PLAYLIST,		///< Add or refresh the row of a playlist
+	UI_PLAYLIST_GONE,	///< Remove the row of a playlist
+	UI_TRACKS,		///< Reload the track list of g_jukeboxlist
+};
 
 enum StoreColumns {
   COL_ONE,
   COL_TWO,
+  COL_PLAYLIST,
   N_COL
 };
 
@@ -100,17 +132,75 @@ enum TracksColumns {
     T_N_COL
 };
 
-void add_row_to_list(const char* name, int numtracks)
+static gboolean ui_drain(gpointer data);
+
+/**
+ * Queue a model update for the GTK thread. Updates posted before the next
+ * ui_drain() are applied together, and repeats for the same playlist are
+ * merged, so a burst of callbacks costs one batch of model changes.
+ */
+static void ui_post(int kind, void *key)
 {
-    GtkTreeModel *model;
-    GtkTreeIter iter;
+	gint64 wait;
 
-    model = gtk_tree_view_get_model (GTK_TREE_VIEW (treeview));
-    gtk_tree_store_append (GTK_TREE_STORE (model), &iter, NULL);
-    gtk_tree_store_set (GTK_TREE_STORE (model), &iter,
-                          COL_ONE, name,
-                          COL_TWO, numtracks,
-                          -1);
+	if (marshal_post(&g_marshal, kind, key) < 0)
+		return;
+
+	if (!__sync_bool_compare_and_swap(&g_drain_scheduled, 0, 1))
+		return;
+
+	wait = UI_DRAIN_INTERVAL_MS - (g_get_monotonic_time() - g_drain_us) / 1000;
+	if (wait < 0)
+		wait = 0;
+
+	/* Behind input and redraws, like the budgeted session source */
+	g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, wait, ui_drain, NULL, NULL);
+}
+
+/**
+ * Log how well ui_post() merged updates, and start counting afresh.
+ */
+static void ui_stats(void)
+{
+	unsigned posts = __sync_lock_test_and_set(&g_marshal.posts, 0);
+
+	fprintf(stderr, "ui: %u updates made %u model changes in %u batches\n",
+	        posts, g_ui_changes, g_ui_batches);
+	g_ui_changes = 0;
+	g_ui_batches = 0;
+}
+
+/**
+ * Bring the row of \p pl up to date, adding it if it is new.
+ */
+static void ui_update_playlist(sp_playlist *pl)
+{
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(treeview));
+    GtkTreeIter *iter = g_hash_table_lookup(g_playlist_rows, pl);
+
+    if (!iter) {
+        iter = g_new(GtkTreeIter, 1);
+        gtk_tree_store_append(GTK_TREE_STORE(model), iter, NULL);
+        g_hash_table_insert(g_playlist_rows, pl, iter);
+    }
+
+    gtk_tree_store_set(GTK_TREE_STORE(model), iter,
+                       COL_ONE, sp_playlist_name(pl),
+                       COL_TWO, sp_playlist_num_tracks(pl),
+                       COL_PLAYLIST, pl,
+                       -1);
+}
+
+static void ui_remove_playlist(sp_playlist *pl)
+{
+    GtkTreeModel *model = gtk_tree_view_get_model(GTK_TREE_VIEW(treeview));
+    GtkTreeIter *iter = g_hash_table_lookup(g_playlist_rows, pl);
+
+    if (!iter)
+        return;
+
+    gtk_tree_store_remove(GTK_TREE_STORE(model), iter);
+    g_hash_table_remove(g_playlist_rows, pl);
 }
 
 
@@ -159,8 +249,13 @@ static void try_jukebox_start(void)
 	printf("jukebox: Now playing \"%s\"...\n", sp_track_name(t));
 	fflush(stdout);
 
+	audio_fifo_mark_track(&g_audiofifo);
 	sp_session_player_load(g_sess, t);
-	sp_session_player_play(g_sess, 1);
+	sp_session_player_play(g_sess, !g_paused);
+
+	/* Have the next track ready so it can follow without a gap */
+	if (g_audioopts.gapless && g_track_index + 1 < sp_playlist_num_tracks(g_jukeboxlist))
+		sp_session_player_prefetch(g_sess, sp_playlist_track(g_jukeboxlist, g_track_index + 1));
 }
 
 
@@ -177,15 +272,12 @@ static void try_jukebox_start(void)
 static void tracks_added(sp_playlist *pl, sp_track * const *tracks,
                          int num_tracks, int position, void *userdata)
 {
-    /* we got playlist, populate listview with content */
-    //printf("List name: %s\n", sp_playlist_name(pl));
-    add_row_to_list(sp_playlist_name(pl), num_tracks);
-    playlists[num_playlists++] = pl;
+	ui_post(UI_PLAYLIST, pl);
 	if (pl != g_jukeboxlist)
 		return;
 
+	ui_post(UI_TRACKS, pl);
 	printf("jukebox: %d tracks were added\n", num_tracks);
-	fflush(stdout);
 	try_jukebox_start();
 }
 
@@ -202,6 +294,7 @@ static void tracks_removed(sp_playlist *pl, const int *tracks,
 {
 	int i, k = 0;
 
+	ui_post(UI_PLAYLIST, pl);
 	if (pl != g_jukeboxlist)
 		return;
 
@@ -211,8 +304,8 @@ static void tracks_removed(sp_playlist *pl, const int *tracks,
 
 	g_track_index -= k;
 
+	ui_post(UI_TRACKS, pl);
 	printf("jukebox: %d tracks were removed\n", num_tracks);
-	fflush(stdout);
 	try_jukebox_start();
 }
 
@@ -231,8 +324,8 @@ static void tracks_moved(sp_playlist *pl, const int *tracks,
 	if (pl != g_jukeboxlist)
 		return;
 
+	ui_post(UI_TRACKS, pl);
 	printf("jukebox: %d tracks were moved around\n", num_tracks);
-	fflush(stdout);
 	try_jukebox_start();
 }
 
@@ -246,6 +339,7 @@ static void playlist_renamed(sp_playlist *pl, void *userdata)
 {
 	const char *name = sp_playlist_name(pl);
 
+	ui_post(UI_PLAYLIST, pl);
 	if (!strcasecmp(name, g_listname)) {
 		g_jukeboxlist = pl;
 		g_track_index = 0;
@@ -284,6 +378,7 @@ static void playlist_added(sp_playlistcontainer *pc, sp_playlist *pl,
                            int position, void *userdata)
 {
 	sp_playlist_add_callbacks(pl, &pl_callbacks, NULL);
+	ui_post(UI_PLAYLIST, pl);
 	if (!strcasecmp(sp_playlist_name(pl), g_listname)) {
         g_jukeboxlist = pl;
 		try_jukebox_start();
@@ -304,6 +399,7 @@ static void playlist_removed(sp_playlistcontainer *pc, sp_playlist *pl,
                              int position, void *userdata)
 {
 	sp_playlist_remove_callbacks(pl, &pl_callbacks, NULL);
+	ui_post(UI_PLAYLIST_GONE, pl);
 }
 
 
@@ -316,8 +412,14 @@ static void playlist_removed(sp_playlistcontainer *pc, sp_playlist *pl,
  */
 static void container_loaded(sp_playlistcontainer *pc, void *userdata)
 {
-	fprintf(stderr, "jukebox: Rootlist synchronized (%d playlists)\n",
-	    sp_playlistcontainer_num_playlists(pc));
+	unsigned posts, wakeups;
+
+	notify_stats(&g_notify, &posts, &wakeups);
+	fprintf(stderr, "jukebox: Rootlist synchronized (%d playlists), "
+	        "%u notifications took %u wakeups\n",
+	        sp_playlistcontainer_num_playlists(pc), posts, wakeups);
+	process_stats(&g_process);
+	ui_stats();
 }
 
 
@@ -354,6 +456,7 @@ static void logged_in(sp_session *sess, sp_error error)
 		sp_playlist *pl = sp_playlistcontainer_playlist(pc, i);
 
 		sp_playlist_add_callbacks(pl, &pl_callbacks, NULL);
+		ui_post(UI_PLAYLIST, pl);
 
 		if (!strcasecmp(sp_playlist_name(pl), g_listname)) {
 			g_jukeboxlist = pl;
@@ -371,16 +474,14 @@ static void logged_in(sp_session *sess, sp_error error)
  * This callback is called from an internal libspotify thread to ask us to
  * reiterate the main loop.
  *
- * We notify the main thread using a condition variable and a protected variable.
+ * We post NOTIFY_EVENTS to the spotify source in the main loop, without
+ * taking a lock. A burst of these before the loop gets to run wakes it once.
  *
  * @sa sp_session_callbacks#notify_main_thread
  */
 static void notify_main_thread(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_notify_do = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	notify_post(&g_notify, NOTIFY_EVENTS);
 }
 
 /**
@@ -391,39 +492,11 @@ static void notify_main_thread(sp_session *sess)
 static int music_delivery(sp_session *sess, const sp_audioformat *format,
                           const void *frames, int num_frames)
 {
-	audio_fifo_t *af = &g_audiofifo;
-	audio_fifo_data_t *afd;
-	size_t s;
-
 	if (num_frames == 0)
 		return 0; // Audio discontinuity, do nothing
 
-	pthread_mutex_lock(&af->mutex);
-
-	/* Buffer one second of audio */
-	if (af->qlen > format->sample_rate) {
-		pthread_mutex_unlock(&af->mutex);
-
-		return 0;
-	}
-
-	s = num_frames * sizeof(int16_t) * format->channels;
-
-	afd = malloc(sizeof(audio_fifo_data_t) + s);
-	memcpy(afd->samples, frames, s);
-
-	afd->nsamples = num_frames;
-
-	afd->rate = format->sample_rate;
-	afd->channels = format->channels;
-
-	TAILQ_INSERT_TAIL(&af->q, afd, link);
-	af->qlen += num_frames;
-
-	pthread_cond_signal(&af->cond);
-	pthread_mutex_unlock(&af->mutex);
-
-	return num_frames;
+	return audio_fifo_put(&g_audiofifo, frames, num_frames,
+	                      format->channels, format->sample_rate);
 }
 
 
@@ -434,10 +507,7 @@ static int music_delivery(sp_session *sess, const sp_audioformat *format,
  */
 static void end_of_track(sp_session *sess)
 {
-	pthread_mutex_lock(&g_notify_mutex);
-	g_playback_done = 1;
-	pthread_cond_signal(&g_notify_cond);
-	pthread_mutex_unlock(&g_notify_mutex);
+	notify_post(&g_notify, NOTIFY_END_OF_TRACK);
 }
 
 
@@ -470,6 +540,39 @@ static void play_token_lost(sp_session *sess)
 	}
 }
 
+/**
+ * Callback from libspotify asking how much audio we have queued and how
+ * many times the driver ran dry since it last asked.
+ *
+ * @sa sp_session_callbacks#get_audio_buffer_stats
+ */
+static void get_audio_buffer_stats(sp_session *sess, sp_audio_buffer_stats *stats)
+{
+	audio_fifo_stats(&g_audiofifo, &stats->samples, &stats->stutter);
+}
+
+/**
+ * Callback from libspotify, audio playback should (re)start.
+ *
+ * @sa sp_session_callbacks#start_playback
+ */
+static void start_playback(sp_session *sess)
+{
+	if (!g_paused)
+		audio_fifo_pause(&g_audiofifo, 0);
+}
+
+/**
+ * Callback from libspotify, audio playback should stop. The driver stops
+ * consuming until start_playback() is called.
+ *
+ * @sa sp_session_callbacks#stop_playback
+ */
+static void stop_playback(sp_session *sess)
+{
+	audio_fifo_pause(&g_audiofifo, 1);
+}
+
 /**
  * The session callbacks
  */
@@ -481,6 +584,9 @@ static sp_session_callbacks session_callbacks = {
 	.play_token_lost = &play_token_lost,
 	.log_message = NULL,
 	.end_of_track = &end_of_track,
+	.start_playback = &start_playback,
+	.stop_playback = &stop_playback,
+	.get_audio_buffer_stats = &get_audio_buffer_stats,
 };
 
 /**
@@ -503,7 +609,8 @@ static sp_session_config spconfig = {
 /**
  * A track has ended. Remove it from the playlist.
  *
- * Called from the main loop when the music_delivery() callback has set g_playback_done.
+ * Called from spotify_dispatch() when the end_of_track() callback has posted
+ * NOTIFY_END_OF_TRACK.
  */
 static void track_ended(void)
 {
@@ -511,7 +618,9 @@ static void track_ended(void)
 
 	if (g_currenttrack) {
 		g_currenttrack = NULL;
-		sp_session_player_unload(g_sess);
+		/* In gapless mode the next load simply replaces the track */
+		if (!g_audioopts.gapless)
+			sp_session_player_unload(g_sess);
 		if (g_remove_tracks) {
 			sp_playlist_remove_tracks(g_jukeboxlist, &tracks, 1);
 		} else {
@@ -522,31 +631,152 @@ static void track_ended(void)
 }
 
 /**
- * Show usage information
+ * Run a transport command. The fifo is paused or flushed before libspotify
+ * is told, so stale audio is dropped without waiting for the session.
  *
- * @param  progname  The program name
+ * Called from the GTK signal handlers, which run on the main loop like the
+ * session does, so libspotify can be called directly.
  */
-static void usage(const char *progname)
+static void transport_run(int cmd, int arg)
 {
-	fprintf(stderr, "usage: %s -u <username> -p <password> -l <listname> [-d]\n", progname);
-	fprintf(stderr, "warning: -d will delete the tracks played from the list!\n");
+	int ms;
+
+	switch (cmd) {
+	case TRANSPORT_PAUSE:
+		g_paused = 1;
+		audio_fifo_pause(&g_audiofifo, 1);
+		sp_session_player_play(g_sess, 0);
+		break;
+
+	case TRANSPORT_RESUME:
+		g_paused = 0;
+		audio_fifo_pause(&g_audiofifo, 0);
+		sp_session_player_play(g_sess, 1);
+		break;
+
+	case TRANSPORT_SKIP:
+		if (g_jukeboxlist) {
+			++g_track_index;
+			try_jukebox_start();
+		}
+		break;
+
+	case TRANSPORT_SEEK:
+		if (!g_currenttrack)
+			break;
+
+		ms = audio_fifo_position(&g_audiofifo, NULL) + arg;
+		if (ms < 0)
+			ms = 0;
+		if (ms > sp_track_duration(g_currenttrack))
+			ms = sp_track_duration(g_currenttrack);
+
+		audio_fifo_seek(&g_audiofifo, ms);
+		sp_session_player_seek(g_sess, ms);
+		break;
+
+	case TRANSPORT_QUIT:
+		/* Let the driver close the device before we go */
+		audio_fifo_shutdown(&g_audiofifo);
+		exit(0);
+	}
 }
 
-void _gtkmain()
+
+/* ---------------------------  MAIN LOOP SOURCE  -------------------------- */
+/**
+ * A GLib source that runs the session on the main loop, next to GTK. It
+ * dispatches when a libspotify thread posts to g_notify, or when the
+ * next_timeout the session last asked for runs out.
+ */
+typedef struct {
+	GSource source;
+	GPollFD pfd;		/* On g_notify.fd */
+	sp_session *sess;
+	gint64 due;		/* Monotonic time the session wants to run again, in us */
+} spotify_source_t;
+
+static gboolean spotify_prepare(GSource *source, gint *timeout)
 {
-    long meh=0;
-    pthread_create(&thread, NULL, gtk_main, (void *)meh);
+	spotify_source_t *ss = (spotify_source_t *)source;
+	gint64 left = ss->due - g_source_get_time(source);
+
+	/* Posted while we were busy elsewhere, no need to poll for it */
+	if (left <= 0 || g_notify.pending) {
+		*timeout = 0;
+		return TRUE;
+	}
+
+	/* Round up, waking a little early would only spin the loop */
+	*timeout = (left + 999) / 1000;
+	return FALSE;
 }
 
-sp_playlist* get_playlist_by_name(gchar *name)
+static gboolean spotify_check(GSource *source)
 {
-    int i;
-    for(i=0; i < num_playlists; i++){
-        if (!strcasecmp(sp_playlist_name(playlists[i]), name))
-        {
-            return playlists[i];
-        }
-    }
+	spotify_source_t *ss = (spotify_source_t *)source;
+
+	return (ss->pfd.revents & G_IO_IN) || ss->due <= g_source_get_time(source);
+}
+
+static gboolean spotify_dispatch(GSource *source, GSourceFunc callback, gpointer data)
+{
+	spotify_source_t *ss = (spotify_source_t *)source;
+	int next_timeout;
+
+	/* Taken first, so a post while we process wakes us again */
+	if (notify_take(&g_notify) & NOTIFY_END_OF_TRACK)
+		track_ended();
+
+	next_timeout = process_events(&g_process, ss->sess);
+	ss->due = g_get_monotonic_time() + (gint64)next_timeout * 1000;
+
+	/*
+	 * Out of budget with work left: come back after GTK has handled input
+	 * and redrawn, which it does at lower priorities than ours
+	 */
+	g_source_set_priority(source, next_timeout ? G_PRIORITY_DEFAULT : G_PRIORITY_DEFAULT_IDLE);
+	return TRUE;
+}
+
+static GSourceFuncs spotify_source_funcs = {
+	spotify_prepare,
+	spotify_check,
+	spotify_dispatch,
+	NULL,
+};
+
+/**
+ * Have the default main context process events for \p sess, starting on
+ * its next iteration.
+ */
+static void spotify_source_attach(sp_session *sess)
+{
+	spotify_source_t *ss;
+
+	ss = (spotify_source_t *)g_source_new(&spotify_source_funcs, sizeof(*ss));
+	ss->sess = sess;
+	ss->due = 0;
+	ss->pfd.fd = g_notify.fd;
+	ss->pfd.events = G_IO_IN;
+	g_source_add_poll(&ss->source, &ss->pfd);
+	g_source_attach(&ss->source, NULL);
+	g_source_unref(&ss->source);
+}
+
+/**
+ * Show usage information
+ *
+ * @param  progname  The program name
+ */
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s -u <username> -p <password> -l <listname> [-d]", progname);
+	audio_synopsis(stderr);
+	fprintf(stderr, " [-E <ms>]\n");
+	fprintf(stderr, "warning: -d will delete the tracks played from the list!\n");
+	audio_help(stderr);
+	fprintf(stderr, "  -E  process session events for at most this many ms before other work gets a turn, 0 for no limit\n");
 }
 
 void add_track_to_track_list(const char* name)
@@ -583,6 +813,9 @@ void loop_current_playlist()
     // clear tracks treeview
     remove_all();
 
+    if (!g_jukeboxlist)
+        return;
+
     int num_tracks = sp_playlist_num_tracks(g_jukeboxlist);
     int i;
     sp_track *track;
@@ -593,6 +826,52 @@ void loop_current_playlist()
     }
 }
 
+/**
+ * Apply the updates ui_post() queued since the last batch. Only the last
+ * update for each playlist is applied, and the track list is reloaded at
+ * most once, however many callbacks asked for it.
+ */
+static gboolean ui_drain(gpointer data)
+{
+    marshal_msg_t *list, *m;
+    GHashTable *last = g_hash_table_new(NULL, NULL);
+    int tracks = 0;
+
+    /* Cleared first, so a post while we work schedules the next batch */
+    g_drain_scheduled = 0;
+    __sync_synchronize();
+    list = marshal_take(&g_marshal);
+
+    for (m = list; m; m = m->next) {
+        if (m->kind == UI_TRACKS)
+            tracks = 1;
+        else
+            g_hash_table_insert(last, m->key, m);
+    }
+
+    for (m = list; m; m = m->next) {
+        if (m->kind == UI_TRACKS || g_hash_table_lookup(last, m->key) != m)
+            continue;
+
+        if (m->kind == UI_PLAYLIST)
+            ui_update_playlist(m->key);
+        else
+            ui_remove_playlist(m->key);
+        g_ui_changes++;
+    }
+
+    if (tracks) {
+        loop_current_playlist();
+        g_ui_changes++;
+    }
+
+    g_hash_table_destroy(last);
+    marshal_free(list);
+    g_ui_batches++;
+    g_drain_us = g_get_monotonic_time();
+    return FALSE;
+}
+
 void onTracksRowActivated(GtkTreeView        *treeview,
                        GtkTreePath        *path,
                        GtkTreeViewColumn  *col,
@@ -627,18 +906,104 @@ void
 
     if (gtk_tree_model_get_iter(model, &iter, path))
     {
-       gchar *name;
+        sp_playlist *pl;
 
-        gtk_tree_model_get(model, &iter, COL_ONE, &name, -1);
-        sp_playlist*  pl = get_playlist_by_name(name);
+        gtk_tree_model_get(model, &iter, COL_PLAYLIST, &pl, -1);
        g_jukeboxlist = pl;
        printf("%s\n",sp_playlist_name(pl));
-       loop_current_playlist();
-
-       g_free(name);
+       ui_post(UI_TRACKS, pl);
     }
   }
 
+void
+  volume_onChanged (GtkRange *range,
+                    gpointer  userdata)
+  {
+    g_audioopts.volume = (int)gtk_range_get_value(range);
+    audio_fifo_set_gain(&g_audiofifo, g_audioopts.volume, g_audioopts.replaygain);
+  }
+
+void
+  btnPause_onClicked (GtkButton *button,
+                      gpointer   userdata)
+  {
+    static int paused;
+
+    paused = !paused;
+    gtk_button_set_label(button, paused ? "Play" : "Pause");
+    transport_run(paused ? TRANSPORT_PAUSE : TRANSPORT_RESUME, 0);
+  }
+
+gboolean
+  win_onDelete (GtkWidget *widget,
+                GdkEvent  *event,
+                gpointer   userdata)
+  {
+    transport_run(TRANSPORT_QUIT, 0);
+    return TRUE;
+  }
+
+void
+  btnNext_onClicked (GtkButton *button,
+                     gpointer   userdata)
+  {
+    transport_run(TRANSPORT_SKIP, 0);
+  }
+
+void
+  btnSeek_onClicked (GtkButton *button,
+                     gpointer   userdata)
+  {
+    transport_run(TRANSPORT_SEEK, GPOINTER_TO_INT(userdata));
+  }
+
+/**
+ * Show what is audible now. The playback clock can be read without
+ * waking the audio thread.
+ */
+gboolean
+  position_onTimeout (gpointer userdata)
+  {
+    char buf[32];
+    int s = audio_fifo_position(&g_audiofifo, NULL) / 1000;
+
+    snprintf(buf, sizeof(buf), "%d:%02d", s / 60, s % 60);
+    gtk_label_set_text(GTK_LABEL(lbl_Position), buf);
+    return TRUE;
+  }
+
+void add_transport_buttons()
+{
+    GtkWidget *btn;
+
+    box_Transport = gtk_hbox_new(FALSE, 2);
+    gtk_table_attach(GTK_TABLE(tbl_Main),
+                     box_Transport,
+                     0, 2, 3, 4,
+                    (GtkAttachOptions)(GTK_FILL),
+                    (GtkAttachOptions)(GTK_FILL), 0, 2);
+
+    btn = gtk_button_new_with_label("<< 10 s");
+    g_signal_connect(btn, "clicked", (GCallback) btnSeek_onClicked, GINT_TO_POINTER(-10000));
+    gtk_box_pack_start(GTK_BOX(box_Transport), btn, FALSE, FALSE, 0);
+
+    btn = gtk_button_new_with_label("Pause");
+    g_signal_connect(btn, "clicked", (GCallback) btnPause_onClicked, NULL);
+    gtk_box_pack_start(GTK_BOX(box_Transport), btn, FALSE, FALSE, 0);
+
+    btn = gtk_button_new_with_label("10 s >>");
+    g_signal_connect(btn, "clicked", (GCallback) btnSeek_onClicked, GINT_TO_POINTER(10000));
+    gtk_box_pack_start(GTK_BOX(box_Transport), btn, FALSE, FALSE, 0);
+
+    btn = gtk_button_new_with_label("Next");
+    g_signal_connect(btn, "clicked", (GCallback) btnNext_onClicked, NULL);
+    gtk_box_pack_start(GTK_BOX(box_Transport), btn, FALSE, FALSE, 0);
+
+    lbl_Position = gtk_label_new("0:00");
+    gtk_box_pack_start(GTK_BOX(box_Transport), lbl_Position, FALSE, FALSE, 4);
+    g_timeout_add(250, position_onTimeout, NULL);
+}
+
 void add_treeview_for_playlist_items()
 {
     GtkWidget *scl = gtk_scrolled_window_new(NULL,
@@ -682,7 +1047,7 @@ int foo()
                                     "PandaUI");
     g_signal_connect(win_Main,                             //widget responding to event
                         "delete_event",                       //
-                        gtk_main_quit,                        //kill window is programmer named
+                        (GCallback) win_onDelete,             //quit through the main thread
                         NULL);
 
     //Table(tbl_Main)
@@ -707,7 +1072,9 @@ int foo()
     /* create the data model */
     model = gtk_tree_store_new(N_COL,
                                G_TYPE_STRING,
-                               G_TYPE_UINT);
+                               G_TYPE_UINT,
+                               G_TYPE_POINTER);
+    g_playlist_rows = g_hash_table_new_full(NULL, NULL, NULL, g_free);
     treeview = gtk_tree_view_new_with_model(GTK_TREE_MODEL(model));
     g_object_unref(model);
 
@@ -744,6 +1111,18 @@ int foo()
                      G_CALLBACK(AddTreeEntry),
                      NULL);*/
 
+    //HScale(scl_Volume)
+    scl_Volume = gtk_hscale_new_with_range(0, 100, 1);
+    gtk_range_set_value(GTK_RANGE(scl_Volume), g_audioopts.volume);
+    gtk_table_attach(GTK_TABLE(tbl_Main),
+                     scl_Volume,
+                     1, 2, 2, 3,
+                    (GtkAttachOptions)(GTK_EXPAND | GTK_FILL),
+                    (GtkAttachOptions)(GTK_FILL), 0, 2);
+    g_signal_connect(scl_Volume, "value-changed", (GCallback) volume_onChanged, NULL);
+
+    add_transport_buttons();
+
   gtk_widget_show_all (win_Main);
 }
 
@@ -753,12 +1132,11 @@ int main(int argc, char **argv)
     foo();
     sp_session *sp;
 	sp_error err;
-	int next_timeout = 0;
 	const char *username = NULL;
 	const char *password = NULL;
 	int opt;
 
-	while ((opt = getopt(argc, argv, "u:p:d")) != EOF) {
+	while ((opt = getopt(argc, argv, audio_optstring("u:p:dE:"))) != EOF) {
 		switch (opt) {
 		case 'u':
 			username = optarg;
@@ -772,7 +1150,14 @@ int main(int argc, char **argv)
 			g_remove_tracks = 1;
 			break;
 
+		case 'E':
+			g_process.budget_ms = atoi(optarg);
+			break;
+
 		default:
+			if (audio_option(&g_audiofifo, &g_audioopts, opt, optarg) > 0)
+				break;
+			usage(basename(argv[0]));
 			exit(1);
 		}
 	}
@@ -785,6 +1170,14 @@ int main(int argc, char **argv)
 	}
 
 	audio_init(&g_audiofifo);
+	audio_fifo_set_gain(&g_audiofifo, g_audioopts.volume, g_audioopts.replaygain);
+	gtk_range_set_value(GTK_RANGE(scl_Volume), g_audioopts.volume);
+
+	/* libspotify may call notify_main_thread() from sp_session_create() on */
+	if (notify_init(&g_notify) < 0) {
+		perror("eventfd");
+		exit(1);
+	}
 
 	/* Create session */
 	spconfig.application_key_size = g_appkey_size;
@@ -799,54 +1192,16 @@ int main(int argc, char **argv)
 
 	g_sess = sp;
 
-	pthread_mutex_init(&g_notify_mutex, NULL);
-	pthread_cond_init(&g_notify_cond, NULL);
-
 	sp_playlistcontainer_add_callbacks(
 		sp_session_playlistcontainer(g_sess),
 		&pc_callbacks,
 		NULL);
 
 	sp_session_login(sp, username, password);
-	pthread_mutex_lock(&g_notify_mutex);
-
-    _gtkmain();
-	for (;;) {
-		if (next_timeout == 0) {
-			while(!g_notify_do && !g_playback_done)
-				pthread_cond_wait(&g_notify_cond, &g_notify_mutex);
-		} else {
-			struct timespec ts;
-
-#if _POSIX_TIMERS > 0
-			clock_gettime(CLOCK_REALTIME, &ts);
-#else
-			struct timeval tv;
-			gettimeofday(&tv, NULL);
-			TIMEVAL_TO_TIMESPEC(&tv, &ts);
-#endif
-			ts.tv_sec += next_timeout / 1000;
-			ts.tv_nsec += (next_timeout % 1000) * 1000000;
-
-			pthread_cond_timedwait(&g_notify_cond, &g_notify_mutex, &ts);
-		}
-
-		g_notify_do = 0;
-		pthread_mutex_unlock(&g_notify_mutex);
 
-		if (g_playback_done) {
-			track_ended();
-			g_playback_done = 0;
-		}
-
-		do {
-			sp_session_process_events(sp, &next_timeout);
-		} while (next_timeout == 0);
-
-		pthread_mutex_lock(&g_notify_mutex);
-
-	}
+	/* The session and GTK share this thread from here on */
+	spotify_source_attach(sp);
+	gtk_main();
 
-	// pthread join?
 	return 0;
 }